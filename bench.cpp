@@ -0,0 +1,117 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+#include <psarena.hpp>
+#include <psdiff.hpp>
+
+/* diff micro-benchmark - PsDiff::mk against the std::map / std::set planning it replaced
+   usage: bench0 [nentry]   (default 1M local entries, the goal changes about 10% of them, adds and drops some) */
+
+using bench_clock_t = std::chrono::steady_clock;
+
+inline ps_sha_t
+_bench_sha(uint64_t v)
+{
+	PsSha256 sha;
+	sha.update(&v, sizeof v);
+	return sha.finish();
+}
+
+inline double
+_bench_ms(bench_clock_t::time_point t0)
+{
+	return std::chrono::duration<double, std::milli>(bench_clock_t::now() - t0).count();
+}
+
+/* the former NupdD::mk + dsf + _missing_checksum planning, reduced to what it allocated and looked up */
+inline size_t
+_bench_map(
+	const std::vector<boost::filesystem::path> &beg_fils,
+	const std::vector<ps_sha_t> &beg_sums,
+	const std::vector<boost::filesystem::path> &goal_fils,
+	const std::vector<ps_sha_t> &goal_sums)
+{
+	std::set<ps_sha_t> sold(beg_sums.begin(), beg_sums.end());
+	std::vector<ps_sha_t> miss;
+	for (const auto &v : goal_sums)
+		if (sold.find(v) == sold.end())
+			miss.push_back(v);
+	std::map<boost::filesystem::path, std::pair<ps_sha_t, ps_sha_t> > dd;
+	for (size_t i = 0; i < goal_fils.size(); i++)
+		dd[goal_fils[i]].first = goal_sums[i];
+	for (size_t i = 0; i < beg_fils.size(); i++)
+		dd[beg_fils[i]].second = beg_sums[i];
+	std::map<ps_sha_t, boost::filesystem::path> dsf;
+	for (size_t i = 0; i < beg_fils.size(); i++)
+		dsf[beg_sums[i]] = beg_fils[i];
+	size_t nwork = 0;
+	for (const auto &[k, v] : dd)
+		nwork += !v.first.empty() && v.first != v.second && (v.second.empty() || dsf.count(v.first));
+	return nwork + miss.size();
+}
+
+int
+main(int argc, char **argv)
+{
+	const size_t n = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+	std::vector<boost::filesystem::path> beg_fils, goal_fils;
+	std::vector<ps_sha_t> beg_sums, goal_sums;
+	char buf[64];
+	for (size_t i = 0; i < n; i++) {
+		snprintf(buf, sizeof buf, "d%03zu/f%07zu.bin", i / 1000, i);
+		beg_fils.push_back(buf);
+		beg_sums.push_back(_bench_sha(i));
+		if (i % 50 == 7)
+			continue;
+		goal_fils.push_back(buf);
+		goal_sums.push_back(_bench_sha(i % 10 == 3 ? n + i : i % 20 == 9 ? i / 2 : i));
+	}
+	for (size_t i = 0; i < n / 20; i++) {
+		snprintf(buf, sizeof buf, "n%03zu/f%07zu.bin", i / 1000, i);
+		goal_fils.push_back(buf);
+		goal_sums.push_back(_bench_sha(i % 2 ? 2 * n + i : i * 7));
+	}
+
+	auto t0 = bench_clock_t::now();
+	const PsDiff d = PsDiff::mk(beg_fils, beg_sums, goal_fils, goal_sums);
+	const double ms_diff = _bench_ms(t0);
+
+	// the same lists as a session would hold them - interned once, referred to by id
+	t0 = bench_clock_t::now();
+	PsStrPool pool;
+	std::vector<PsStrPool::id_t> beg_ids, goal_ids;
+	for (const auto &f : beg_fils)
+		beg_ids.push_back(pool.intern(f.native()));
+	for (const auto &f : goal_fils)
+		goal_ids.push_back(pool.intern(f.native()));
+	const double ms_intern = _bench_ms(t0);
+	t0 = bench_clock_t::now();
+	const PsDiff d_ = PsDiff::mk(pool, beg_ids, beg_sums, pool, goal_ids, goal_sums);
+	const double ms_diff_ = _bench_ms(t0);
+	if (d_.m_copy.size() != d.m_copy.size() || d_.m_dl.size() != d.m_dl.size())
+		return EXIT_FAILURE;
+
+	t0 = bench_clock_t::now();
+	const size_t nwork = _bench_map(beg_fils, beg_sums, goal_fils, goal_sums);
+	const double ms_map = _bench_ms(t0);
+
+	printf("entries  %zu local, %zu goal\n", beg_fils.size(), goal_fils.size());
+	printf("plan     keep %zu, move %zu, copy %zu, download %zu (%zu paths)\n", d.m_keep.size(), d.m_move.size(), d.m_copy.size(), d.m_dl.size(), d.m_dl_goal.size());
+	printf("PsDiff   %.1f ms\n", ms_diff);
+	printf("PsDiff   %.1f ms over interned ids (intern %.1f ms, %zu strings, %zu arena bytes)\n", ms_diff_, ms_intern, pool.size(), pool.m_arena.nbyte());
+	printf("std::map %.1f ms (%zu)\n", ms_map, nwork);
+
+	return EXIT_SUCCESS;
+}
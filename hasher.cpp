@@ -1,26 +1,488 @@
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <istream>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <tuple>
 
-#include <boost/algorithm/hex.hpp>
 #include <boost/filesystem.hpp>
 
 #include <hasher.hpp>
 
-#ifndef PS_USE_BCRYPT_WIN
-
 #include <ext/picosha2.h>
 
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define PS_SHA_HAVE_SHANI
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t g_sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void
+_sha_blocks_picosha2(uint32_t state[8], const unsigned char *data, size_t nblock)
+{
+	picosha2::word_t h[8];
+	std::copy(state, state + 8, h);
+	for (size_t i = 0; i < nblock; i++)
+		picosha2::detail::hash256_block(h, data + i * 64, data + i * 64 + 64);
+	std::copy(h, h + 8, state);
+}
+
+#ifdef PS_SHA_HAVE_SHANI
+
+/* sha256rnds2 works on the state split as ABEF/CDGH, 4 rounds per loop iteration.
+   message words for rounds 16..63 are produced by sha256msg1/sha256msg2 from the previous 16. */
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+_sha_blocks_shani(uint32_t state[8], const unsigned char *data, size_t nblock)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+	__m128i st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+	__m128i st0 = _mm_alignr_epi8(tmp, st1, 8);
+	st1 = _mm_blend_epi16(st1, tmp, 0xF0);
+
+	for (size_t n = 0; n < nblock; n++, data += 64) {
+		const __m128i abef = st0;
+		const __m128i cdgh = st1;
+		__m128i m[4];
+#pragma GCC unroll 16
+		for (int i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + i * 16)), mask);
+			__m128i msg = _mm_add_epi32(m[i % 4], _mm_loadu_si128((const __m128i *) &g_sha_k[i * 4]));
+			st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+			if (i >= 3 && i <= 14) {
+				m[(i + 1) % 4] = _mm_add_epi32(m[(i + 1) % 4], _mm_alignr_epi8(m[i % 4], m[(i + 3) % 4], 4));
+				m[(i + 1) % 4] = _mm_sha256msg2_epu32(m[(i + 1) % 4], m[i % 4]);
+			}
+			st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0E));
+			if (i >= 1 && i <= 12)
+				m[(i + 3) % 4] = _mm_sha256msg1_epu32(m[(i + 3) % 4], m[i % 4]);
+		}
+		st0 = _mm_add_epi32(st0, abef);
+		st1 = _mm_add_epi32(st1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(st0, 0x1B);
+	st1 = _mm_shuffle_epi32(st1, 0xB1);
+	_mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(tmp, st1, 0xF0));
+	_mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(st1, tmp, 8));
+}
+
+static bool
+_cpu_has_shani()
+{
+	unsigned int a = 0, b = 0, c = 0, d = 0;
+	if (!__get_cpuid(1, &a, &b, &c, &d))
+		return false;
+	const bool ssse3 = c & (1u << 9), sse41 = c & (1u << 19);
+	if (__get_cpuid_max(0, nullptr) < 7)
+		return false;
+	__cpuid_count(7, 0, a, b, c, d);
+	return ssse3 && sse41 && (b & (1u << 29));
+}
+
+#endif /* PS_SHA_HAVE_SHANI */
+
+bool
+_sha_engine_available(ps_sha_engine_t engine)
+{
+	switch (engine) {
+	case ps_sha_engine_t::Auto:
+	case ps_sha_engine_t::Picosha2:
+		return true;
+	case ps_sha_engine_t::ShaNi:
+#ifdef PS_SHA_HAVE_SHANI
+		{
+			static const bool has = _cpu_has_shani();
+			return has;
+		}
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+ps_sha_engine_t
+_sha_engine_detect()
+{
+	if (_sha_engine_available(ps_sha_engine_t::ShaNi))
+		return ps_sha_engine_t::ShaNi;
+	return ps_sha_engine_t::Picosha2;
+}
+
+static ps_sha_blockfn_t
+_sha_engine_blockfn(ps_sha_engine_t engine)
+{
+	if (engine == ps_sha_engine_t::Auto)
+		engine = _sha_engine_detect();
+	if (!_sha_engine_available(engine))
+		throw std::runtime_error("");
+	switch (engine) {
+#ifdef PS_SHA_HAVE_SHANI
+	case ps_sha_engine_t::ShaNi:
+		return _sha_blocks_shani;
+#endif
+	default:
+		return _sha_blocks_picosha2;
+	}
+}
+
+PsSha256::PsSha256(ps_sha_engine_t engine) :
+	m_blockfn(_sha_engine_blockfn(engine)),
+	m_h{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 },
+	m_buf(),
+	m_buflen(0),
+	m_len(0)
+{}
+
+void
+PsSha256::update(const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	m_len += len;
+	if (m_buflen) {
+		const size_t n = std::min(len, sizeof m_buf - m_buflen);
+		memcpy(m_buf + m_buflen, p, n);
+		m_buflen += n, p += n, len -= n;
+		if (m_buflen < sizeof m_buf)
+			return;
+		m_blockfn(m_h, m_buf, 1);
+		m_buflen = 0;
+	}
+	if (len >= 64)
+		m_blockfn(m_h, p, len / 64);
+	p += len / 64 * 64;
+	len %= 64;
+	memcpy(m_buf, p, len);
+	m_buflen = len;
+}
+
+std::string
+PsSha256::finish_bin()
+{
+	const uint64_t bits = m_len * 8;
+	unsigned char pad[128] = { 0x80 };
+	const size_t padlen = (m_buflen < 56 ? 56 : 120) - m_buflen;
+	for (size_t i = 0; i < 8; i++)
+		pad[padlen + i] = (unsigned char) (bits >> (56 - 8 * i));
+	update(pad, padlen + 8);
+	assert(m_buflen == 0);
+	std::string sha(32, '\0');
+	for (size_t i = 0; i < 32; i++)
+		sha[i] = (char) (m_h[i / 4] >> (24 - 8 * (i % 4)));
+	return sha;
+}
+
 ps_sha_t
-_fname_checksum(const boost::filesystem::path &file)
+PsSha256::finish()
+{
+	return ps_sha_t::from_bin(finish_bin().data());
+}
+
+std::string
+PsSha256::save() const
+{
+	std::string st(105, '\0');
+	for (size_t i = 0; i < 32; i++)
+		st[i] = (char) (m_h[i / 4] >> (24 - 8 * (i % 4)));
+	for (size_t i = 0; i < 8; i++)
+		st[32 + i] = (char) (m_len >> (56 - 8 * i));
+	st[40] = (char) m_buflen;
+	memcpy(&st[41], m_buf, 64);
+	return st;
+}
+
+void
+PsSha256::restore(const std::string &st)
 {
-	unsigned char sha[picosha2::k_digest_size] = {};
+	if (st.size() != 105 || (unsigned char) st[40] >= 64)
+		throw std::runtime_error("");
+	uint64_t len = 0;
+	for (size_t i = 0; i < 8; i++)
+		len = len << 8 | (unsigned char) st[32 + i];
+	if (len % 64 != (unsigned char) st[40])
+		throw std::runtime_error("");
+	for (size_t i = 0; i < 8; i++)
+		m_h[i] = (uint32_t) (unsigned char) st[4 * i] << 24 | (uint32_t) (unsigned char) st[4 * i + 1] << 16 | (uint32_t) (unsigned char) st[4 * i + 2] << 8 | (unsigned char) st[4 * i + 3];
+	m_len = len;
+	m_buflen = (unsigned char) st[40];
+	memcpy(m_buf, &st[41], 64);
+}
+
+static std::atomic<uint64_t> g_read_stat[3][4];
+
+PsReadStat
+_read_stat()
+{
+	PsReadStat r;
+	for (size_t i = 0; i < 4; i++) {
+		r.m_nfile[i] = g_read_stat[0][i];
+		r.m_nbyte[i] = g_read_stat[1][i];
+		r.m_ns[i] = g_read_stat[2][i];
+	}
+	return r;
+}
+
+void
+_read_stat_reset()
+{
+	for (auto &s : g_read_stat)
+		for (auto &v : s)
+			v = 0;
+}
+
+static uint64_t
+_hash_stream(const boost::filesystem::path &file, PsSha256 &sha)
+{
+	bool pending_end = false;
+	char buf[16 * 4096] = {};
+	uint64_t nbyte = 0;
 	std::ifstream ifst = boost::filesystem::ifstream(file, std::ios_base::in | std::ios_base::binary);
-	picosha2::hash256(ifst, std::begin(sha), std::end(sha));
-	return boost::algorithm::hex(std::string(std::begin(sha), std::end(sha)));
+	if (!ifst.is_open())
+		throw std::runtime_error("");
+	do {
+		if ((pending_end = !ifst.read(buf, sizeof buf)); ifst.gcount())
+			sha.update(buf, ifst.gcount()), nbyte += ifst.gcount();
+	} while (!pending_end);
+	if (!ifst.eof())
+		throw std::runtime_error("");
+	return nbyte;
+}
+
+#ifdef __linux__
+
+class PsFd
+{
+public:
+	inline PsFd(int fd) : m_fd(fd) {}
+	inline ~PsFd() { if (m_fd >= 0) ::close(m_fd); }
+	PsFd(const PsFd &) = delete;
+	PsFd &operator=(const PsFd &) = delete;
+
+	int m_fd;
+};
+
+class PsMap
+{
+public:
+	inline PsMap(int fd, size_t size) :
+		m_p(size ? ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr),
+		m_size(size)
+	{
+		if (m_p == MAP_FAILED)
+			throw std::runtime_error("");
+	}
+	inline ~PsMap() { if (m_p) ::munmap(m_p, m_size); }
+	PsMap(const PsMap &) = delete;
+	PsMap &operator=(const PsMap &) = delete;
+
+	void *m_p;
+	size_t m_size;
+};
+
+static const size_t g_read_small = 256 * 1024;
+static const size_t g_read_direct_buf = 1024 * 1024;
+
+static uint64_t
+_hash_mmap(const PsMap &map, PsSha256 &sha)
+{
+	if (!map.m_p)
+		return 0;
+	::madvise(map.m_p, map.m_size, MADV_SEQUENTIAL);
+	sha.update(map.m_p, map.m_size);
+	return map.m_size;
+}
+
+/* samples up to 64 pages of the mapping - resident if at least half of them are in the page cache */
+static bool
+_map_resident(const PsMap &map)
+{
+	const size_t pgsz = ::sysconf(_SC_PAGESIZE);
+	const size_t npage = (map.m_size + pgsz - 1) / pgsz;
+	const size_t step = std::max<size_t>(npage / 64, 1);
+	size_t nsample = 0, nresident = 0;
+	for (size_t i = 0; i < npage; i += step, nsample++) {
+		unsigned char vec = 0;
+		if (::mincore((char *) map.m_p + i * pgsz, 1, &vec) == 0 && (vec & 1))
+			nresident++;
+	}
+	return nresident * 2 >= nsample;
+}
+
+static ssize_t
+_pread_full(int fd, unsigned char *buf, size_t len, off_t off)
+{
+	size_t n = 0;
+	while (n < len) {
+		const ssize_t r = ::pread(fd, buf + n, len - n, off + n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		n += r;
+	}
+	return n;
+}
+
+/* reader thread fills buffer i%2 while the calling thread hashes the other one */
+static uint64_t
+_hash_direct(const boost::filesystem::path &file, PsSha256 &sha)
+{
+	PsFd fd(::open(file.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC));
+	if (fd.m_fd < 0 && errno == EINVAL)
+		fd.m_fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd.m_fd < 0)
+		throw std::runtime_error("");
+	::posix_fadvise(fd.m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	std::unique_ptr<unsigned char, decltype(&free)> mem((unsigned char *) ::aligned_alloc(4096, 2 * g_read_direct_buf), &free);
+	if (!mem)
+		throw std::bad_alloc();
+	unsigned char *buf[2] = { mem.get(), mem.get() + g_read_direct_buf };
+	ssize_t len[2] = {};
+	bool full[2] = {};
+	bool stop = false;
+	std::mutex mtx;
+	std::condition_variable cv;
+
+	std::thread reader([&]() {
+		for (size_t i = 0, off = 0;; i++) {
+			std::unique_lock<std::mutex> l(mtx);
+			cv.wait(l, [&]() { return stop || !full[i % 2]; });
+			if (stop)
+				return;
+			l.unlock();
+			ssize_t n = _pread_full(fd.m_fd, buf[i % 2], g_read_direct_buf, off);
+			if (n < 0 && errno == EINVAL && i == 0) {
+				/* filesystem accepted O_DIRECT at open but refuses the reads */
+				::fcntl(fd.m_fd, F_SETFL, ::fcntl(fd.m_fd, F_GETFL) & ~O_DIRECT);
+				n = _pread_full(fd.m_fd, buf[i % 2], g_read_direct_buf, off);
+			}
+			l.lock();
+			len[i % 2] = n;
+			full[i % 2] = true;
+			cv.notify_all();
+			if (n < (ssize_t) g_read_direct_buf)
+				return;
+			off += n;
+		}
+	});
+
+	uint64_t nbyte = 0;
+	bool fail = false;
+	for (size_t i = 0;; i++) {
+		std::unique_lock<std::mutex> l(mtx);
+		cv.wait(l, [&]() { return full[i % 2]; });
+		const ssize_t n = len[i % 2];
+		l.unlock();
+		if (n < 0) {
+			fail = true;
+			break;
+		}
+		sha.update(buf[i % 2], n);
+		nbyte += n;
+		l.lock();
+		full[i % 2] = false;
+		cv.notify_all();
+		if (n < (ssize_t) g_read_direct_buf)
+			break;
+	}
+	{
+		std::lock_guard<std::mutex> l(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	reader.join();
+	if (fail)
+		throw std::runtime_error("");
+	return nbyte;
+}
+
+static uint64_t
+_hash_file(const boost::filesystem::path &file, PsSha256 &sha, ps_read_t &read)
+{
+	if (read == ps_read_t::Stream)
+		return _hash_stream(file, sha);
+	if (read == ps_read_t::Direct)
+		return _hash_direct(file, sha);
+	PsFd fd(::open(file.c_str(), O_RDONLY | O_CLOEXEC));
+	struct stat st = {};
+	if (fd.m_fd < 0 || ::fstat(fd.m_fd, &st) != 0)
+		throw std::runtime_error("");
+	PsMap map(fd.m_fd, st.st_size);
+	if (read == ps_read_t::Auto && st.st_size > (off_t) g_read_small && !_map_resident(map)) {
+		read = ps_read_t::Direct;
+		return _hash_direct(file, sha);
+	}
+	read = ps_read_t::Mmap;
+	return _hash_mmap(map, sha);
+}
+
+#else /* __linux__ */
+
+static uint64_t
+_hash_file(const boost::filesystem::path &file, PsSha256 &sha, ps_read_t &read)
+{
+	read = ps_read_t::Stream;
+	return _hash_stream(file, sha);
+}
+
+#endif /* __linux__ */
+
+ps_sha_t
+_fname_checksum(const boost::filesystem::path &file, ps_sha_engine_t engine, ps_read_t read)
+{
+	const auto t0 = std::chrono::steady_clock::now();
+	PsSha256 sha(engine);
+	const uint64_t nbyte = _hash_file(file, sha, read);
+	const auto t1 = std::chrono::steady_clock::now();
+	g_read_stat[0][(size_t) read]++;
+	g_read_stat[1][(size_t) read] += nbyte;
+	g_read_stat[2][(size_t) read] += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+	return sha.finish();
+}
+
+ps_sha_t
+_fname_checksum(const boost::filesystem::path &file, ps_sha_engine_t engine)
+{
+	return _fname_checksum(file, engine, ps_read_t::Auto);
+}
+
+#ifndef PS_USE_BCRYPT_WIN
+
+ps_sha_t
+_fname_checksum(const boost::filesystem::path &file)
+{
+	return _fname_checksum(file, ps_sha_engine_t::Auto, ps_read_t::Auto);
 }
 
 #else /* PS_USE_BCRYPT_WIN */
@@ -123,7 +585,10 @@ _fname_checksum_bin(const boost::filesystem::path &file)
 ps_sha_t
 _fname_checksum(const boost::filesystem::path &file)
 {
-	return boost::algorithm::hex(_fname_checksum_bin(file));
+	const std::string bin = _fname_checksum_bin(file);
+	if (bin.size() != 32)
+		throw std::runtime_error("");
+	return ps_sha_t::from_bin(bin.data());
 }
 
 #endif /* PS_USE_BCRYPT_WIN */
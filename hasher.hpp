@@ -1,12 +1,181 @@
 #ifndef _HASHER_HPP_
 #define _HASHER_HPP_
 
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 
 #include <boost/filesystem.hpp>
 
-using ps_sha_t = std::string;
+/* sha256 digest held as its 32 raw bytes - trivially copyable, compared and hashed without allocating
+   the all-zero digest doubles as "no content" (see empty), hex() is the uppercase form used by the text listfile */
+class PsSha
+{
+public:
+	constexpr PsSha() = default;
+
+	inline static PsSha
+	from_bin(const void *data)
+	{
+		PsSha r;
+		memcpy(r.m_d.data(), data, 32);
+		return r;
+	}
+
+	/* 64 hex digits, either case */
+	constexpr static PsSha
+	from_hex(std::string_view hex)
+	{
+		if (hex.size() != 64)
+			throw std::runtime_error("");
+		PsSha r;
+		for (size_t i = 0; i < 32; i++)
+			r.m_d[i] = (unsigned char) (_unhex(hex[2 * i]) << 4 | _unhex(hex[2 * i + 1]));
+		return r;
+	}
+
+	constexpr std::array<char, 64>
+	hex_arr() const
+	{
+		constexpr const char digits[] = "0123456789ABCDEF";
+		std::array<char, 64> r = {};
+		for (size_t i = 0; i < 32; i++) {
+			r[2 * i] = digits[m_d[i] >> 4];
+			r[2 * i + 1] = digits[m_d[i] & 0xF];
+		}
+		return r;
+	}
+
+	inline std::string hex() const { const auto r = hex_arr(); return std::string(r.data(), r.size()); }
+	inline std::string bin() const { return std::string((const char *) m_d.data(), m_d.size()); }
+
+	constexpr bool
+	empty() const
+	{
+		for (size_t i = 0; i < 32; i++)
+			if (m_d[i])
+				return false;
+		return true;
+	}
+
+	/* the digest is already uniformly distributed, its first 8 bytes make a good enough table hash */
+	inline size_t
+	hash() const
+	{
+		uint64_t h = 0;
+		memcpy(&h, m_d.data(), sizeof h);
+		return (size_t) h;
+	}
+
+	inline bool operator==(const PsSha &other) const { return memcmp(m_d.data(), other.m_d.data(), 32) == 0; }
+	inline bool operator!=(const PsSha &other) const { return !(*this == other); }
+	inline bool operator<(const PsSha &other) const { return memcmp(m_d.data(), other.m_d.data(), 32) < 0; }
+
+	constexpr static unsigned
+	_unhex(char c)
+	{
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		throw std::runtime_error("");
+	}
+
+	std::array<unsigned char, 32> m_d = {};
+};
+
+inline std::ostream &
+operator<<(std::ostream &os, const PsSha &sha)
+{
+	const auto r = sha.hex_arr();
+	return os.write(r.data(), r.size());
+}
+
+inline std::istream &
+operator>>(std::istream &is, PsSha &sha)
+{
+	std::string hex;
+	if (is >> hex) {
+		try {
+			sha = PsSha::from_hex(hex);
+		}
+		catch (const std::runtime_error &) {
+			is.setstate(std::ios_base::failbit);
+		}
+	}
+	return is;
+}
+
+namespace std {
+template<>
+struct hash<PsSha>
+{
+	inline size_t operator()(const PsSha &sha) const { return sha.hash(); }
+};
+}
+
+using ps_sha_t = PsSha;
+
+/* Auto resolves to the fastest engine the running cpu supports (see _sha_engine_detect) */
+enum class ps_sha_engine_t { Auto, Picosha2, ShaNi };
+
+using ps_sha_blockfn_t = void (*)(uint32_t state[8], const unsigned char *data, size_t nblock);
+
+class PsSha256
+{
+public:
+	PsSha256(ps_sha_engine_t engine = ps_sha_engine_t::Auto);
+
+	void update(const void *data, size_t len);
+	std::string finish_bin();
+	ps_sha_t finish();
+
+	/* the running state (not the engine) as 105 bytes, for checkpointing a hash over a long stream -
+	   restore throws on anything save did not produce */
+	std::string save() const;
+	void restore(const std::string &st);
+
+	ps_sha_blockfn_t m_blockfn;
+	uint32_t m_h[8];
+	unsigned char m_buf[64];
+	size_t m_buflen;
+	uint64_t m_len;
+};
+
+/* how file contents reach the hasher
+     Stream: buffered ifstream reads
+     Mmap:   mmap + MADV_SEQUENTIAL, the mapping is hashed in place
+     Direct: large aligned O_DIRECT preads, double buffered on a reader thread (plain preads where O_DIRECT is refused)
+     Auto:   Mmap for small or page-cache resident files, Direct otherwise
+   outside linux every mode reads as Stream */
+enum class ps_read_t { Auto, Stream, Mmap, Direct };
+
+/* per read mode totals (indexed by ps_read_t), accumulated over all _fname_checksum calls */
+class PsReadStat
+{
+public:
+	uint64_t m_nfile[4] = {};
+	uint64_t m_nbyte[4] = {};
+	uint64_t m_ns[4] = {};
+};
+
+bool _sha_engine_available(ps_sha_engine_t engine);
+ps_sha_engine_t _sha_engine_detect();
+
+PsReadStat _read_stat();
+void _read_stat_reset();
 
 ps_sha_t _fname_checksum(const boost::filesystem::path &file);
+ps_sha_t _fname_checksum(const boost::filesystem::path &file, ps_sha_engine_t engine);
+ps_sha_t _fname_checksum(const boost::filesystem::path &file, ps_sha_engine_t engine, ps_read_t read);
 
 #endif /* _HASHER_HPP_ */
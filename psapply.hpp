@@ -0,0 +1,340 @@
+#ifndef _PSAPPLY_HPP_
+#define _PSAPPLY_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <psfs.hpp>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* transactional apply - every file an update writes is staged in <statedir>/stage, the stage is made durable
+   with a single sync, then the renames into the tree are recorded in an intent log (<statedir>/intent.psil)
+   before any of them is done
+   a crash leaves the log behind, the next PsApply (or _apply_recover) then replays the remaining renames
+   or rolls the done ones back - every step's completion can be told from the tree itself
+   the stage sits beside ourroot (see _statedir) and has to be on the same filesystem */
+inline boost::filesystem::path
+_stage_path(const boost::filesystem::path &ourroot)
+{
+	return _statedir(ourroot) / "stage";
+}
+
+inline boost::filesystem::path
+_intent_path(const boost::filesystem::path &ourroot)
+{
+	return _statedir(ourroot) / "intent.psil";
+}
+
+/* one step of the intent log
+     'N' rename staged m_stage to m_rel, where nothing is      - done once m_stage is gone
+     'X' exchange staged m_stage with the file at m_rel        - done once m_rel is inode m_ino, m_stage then holds the old file
+     'D' displace whatever is at m_rel (a file in the way of a directory, a directory in the way of a file) to m_stage
+                                                               - done once m_stage exists */
+class PsApplyOp
+{
+public:
+	char m_kind = 'N';
+	uint64_t m_ino = 0;
+	std::string m_stage;
+	std::string m_rel;
+};
+
+/* inode at path (not following symlinks), 0 when there is nothing */
+inline uint64_t
+_lstat_ino(const boost::filesystem::path &path)
+{
+#ifndef _WIN32
+	struct stat st = {};
+	return ::lstat(path.c_str(), &st) == 0 ? st.st_ino : 0;
+#else
+	return boost::filesystem::exists(path) ? _fname_stat(path).m_ino : 0;
+#endif
+}
+
+/* renames src to dst, atomically exchanging the two when xchg (both exist), refusing to replace dst otherwise
+   filesystems without renameat2 get the exchange as three renames through "<src>.x" (see _apply_fix) */
+inline void
+_rename2(const boost::filesystem::path &src, const boost::filesystem::path &dst, bool xchg)
+{
+#ifdef __linux__
+	if (::syscall(SYS_renameat2, AT_FDCWD, src.c_str(), AT_FDCWD, dst.c_str(), xchg ? RENAME_EXCHANGE : RENAME_NOREPLACE) == 0)
+		return;
+	if (errno != ENOSYS && errno != EINVAL)
+		throw std::runtime_error("");
+#endif
+	if (!xchg) {
+		if (boost::filesystem::exists(boost::filesystem::symlink_status(dst)))
+			throw std::runtime_error("");
+		boost::filesystem::rename(src, dst);
+		return;
+	}
+	const boost::filesystem::path x = src.string() + ".x";
+	boost::filesystem::rename(dst, x);
+	boost::filesystem::rename(src, dst);
+	boost::filesystem::rename(x, src);
+}
+
+inline std::string
+_apply_log_write(const std::vector<PsApplyOp> &ops)
+{
+	std::string buf;
+	for (const auto &op : ops) {
+		buf += op.m_kind + std::to_string(op.m_ino);
+		buf.append(1, '\0').append(op.m_stage).append(1, '\0').append(op.m_rel).append(1, '\0');
+	}
+	return buf;
+}
+
+inline std::vector<PsApplyOp>
+_apply_log_read(const std::string &buf)
+{
+	std::vector<std::string> f;
+	for (size_t off = 0, end; off < buf.size(); off = end + 1) {
+		if ((end = buf.find('\0', off)) == std::string::npos)
+			throw std::runtime_error("");
+		f.push_back(buf.substr(off, end - off));
+	}
+	if (f.size() % 3)
+		throw std::runtime_error("");
+	std::vector<PsApplyOp> ops(f.size() / 3);
+	for (size_t i = 0; i < ops.size(); i++) {
+		const std::string &k = f[3 * i];
+		if (k.size() < 2 || (k[0] != 'N' && k[0] != 'X' && k[0] != 'D') || k.find_first_not_of("0123456789", 1) != std::string::npos)
+			throw std::runtime_error("");
+		ops[i].m_kind = k[0];
+		ops[i].m_ino = std::stoull(k.substr(1));
+		ops[i].m_stage = std::move(f[3 * i + 1]);
+		ops[i].m_rel = std::move(f[3 * i + 2]);
+	}
+	return ops;
+}
+
+/* completes an exchange _rename2 was doing as three renames when interrupted */
+inline void
+_apply_fix(const boost::filesystem::path &ourroot, const boost::filesystem::path &stage, const PsApplyOp &op)
+{
+	const boost::filesystem::path x = (stage / op.m_stage).string() + ".x";
+	if (op.m_kind != 'X' || !boost::filesystem::exists(boost::filesystem::symlink_status(x)))
+		return;
+	if (!_lstat_ino(ourroot / op.m_rel))
+		boost::filesystem::rename(stage / op.m_stage, ourroot / op.m_rel);
+	boost::filesystem::rename(x, stage / op.m_stage);
+}
+
+inline bool
+_apply_done(const boost::filesystem::path &ourroot, const boost::filesystem::path &stage, const PsApplyOp &op)
+{
+	switch (op.m_kind) {
+	case 'N': return !_lstat_ino(stage / op.m_stage);
+	case 'X': return _lstat_ino(ourroot / op.m_rel) == op.m_ino;
+	default: return _lstat_ino(stage / op.m_stage) != 0;
+	}
+}
+
+inline void
+_apply_do(const boost::filesystem::path &ourroot, const boost::filesystem::path &stage, const PsApplyOp &op)
+{
+	if (op.m_kind == 'D') {
+		// gone meanwhile - nothing is in the way any more
+		if (_lstat_ino(ourroot / op.m_rel))
+			_rename2(ourroot / op.m_rel, stage / op.m_stage, false);
+		return;
+	}
+	boost::filesystem::create_directories((ourroot / op.m_rel).parent_path());
+	_rename2(stage / op.m_stage, ourroot / op.m_rel, op.m_kind == 'X');
+}
+
+/* directories created for a placement are not removed, except an empty one standing where a displaced file goes back */
+inline void
+_apply_undo(const boost::filesystem::path &ourroot, const boost::filesystem::path &stage, const PsApplyOp &op)
+{
+	switch (op.m_kind) {
+	case 'N':
+		_rename2(ourroot / op.m_rel, stage / op.m_stage, false);
+		break;
+	case 'X':
+		_rename2(stage / op.m_stage, ourroot / op.m_rel, true);
+		break;
+	default:
+		if (boost::filesystem::is_directory(boost::filesystem::symlink_status(ourroot / op.m_rel)) && boost::filesystem::is_empty(ourroot / op.m_rel))
+			boost::filesystem::remove(ourroot / op.m_rel);
+		_rename2(stage / op.m_stage, ourroot / op.m_rel, false);
+	}
+}
+
+/* brings the tree to the state after (or, with rollback, before) the logged ops, makes that durable,
+   then drops the log and the stage with whatever was displaced into it */
+inline void
+_apply_run(const boost::filesystem::path &ourroot, const std::vector<PsApplyOp> &ops, bool rollback)
+{
+	const auto stage = _stage_path(ourroot);
+	for (const auto &op : ops)
+		_apply_fix(ourroot, stage, op);
+	if (rollback) {
+		for (auto it = ops.rbegin(); it != ops.rend(); ++it)
+			if (_apply_done(ourroot, stage, *it))
+				_apply_undo(ourroot, stage, *it);
+	}
+	else {
+		for (const auto &op : ops)
+			if (!_apply_done(ourroot, stage, op))
+				_apply_do(ourroot, stage, op);
+	}
+	std::vector<boost::filesystem::path> dirs;
+	for (const auto &op : ops)
+		dirs.push_back((ourroot / op.m_rel).parent_path());
+	std::sort(dirs.begin(), dirs.end());
+	dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+	dirs.erase(std::remove_if(dirs.begin(), dirs.end(), [](const auto &d) { return !boost::filesystem::is_directory(d); }), dirs.end());
+	dirs.insert(dirs.begin(), stage);
+	_sync_paths(dirs);
+	boost::filesystem::remove(_intent_path(ourroot));
+	boost::filesystem::remove_all(stage);
+}
+
+/* finishes an apply interrupted by a crash (or rolls it back), then clears the stage */
+inline void
+_apply_recover(const boost::filesystem::path &ourroot, bool rollback = false)
+{
+	if (boost::filesystem::exists(_intent_path(ourroot))) {
+		std::string buf;
+		{
+			boost::filesystem::ifstream ifst = boost::filesystem::ifstream(_intent_path(ourroot), std::ios_base::in | std::ios_base::binary);
+			buf.assign(std::istreambuf_iterator<char>(ifst), std::istreambuf_iterator<char>());
+			if (ifst.bad())
+				throw std::runtime_error("");
+		}
+		_apply_run(ourroot, _apply_log_read(buf), rollback);
+	}
+	boost::filesystem::remove_all(_stage_path(ourroot));
+}
+
+/* one update's writes - add hands out the stage path where the content of a goal path is to be created,
+   commit then puts all of them in place (displacing what is there into the stage)
+   files under m_stage other than those handed out by add (downloads in progress, say) are discarded by commit
+   destroying an uncommitted PsApply discards the stage, unless the intent log was already written
+   add and commit are not thread-safe, creating files in the stage is */
+class PsApply
+{
+public:
+	inline PsApply(const boost::filesystem::path &ourroot) :
+		m_root(ourroot),
+		m_stage(_stage_path(ourroot)),
+		m_put(),
+		m_ops(),
+		m_logged(false),
+		m_done(false)
+	{
+		_apply_recover(m_root);
+		boost::filesystem::create_directories(m_stage);
+#ifndef _WIN32
+		struct stat st0 = {}, st1 = {};
+		if (::stat(m_root.c_str(), &st0) == 0 && (::stat(m_stage.c_str(), &st1) != 0 || st0.st_dev != st1.st_dev))
+			throw std::runtime_error("");
+#endif
+	}
+
+	inline ~PsApply()
+	{
+		boost::system::error_code ec;
+		if (!m_done && !m_logged)
+			boost::filesystem::remove_all(m_stage, ec);
+	}
+
+	PsApply(const PsApply &) = delete;
+	PsApply &operator=(const PsApply &) = delete;
+
+	/* stage path for the content of rel (relative to ourroot) - the caller creates the file there */
+	inline boost::filesystem::path
+	add(const boost::filesystem::path &rel)
+	{
+		if (m_logged)
+			throw std::runtime_error("");
+		const std::string s = "n" + std::to_string(m_put.size());
+		m_put.push_back(std::make_pair(rel.generic_string(), s));
+		return m_stage / s;
+	}
+
+	/* plans the ops against the tree as it is now, syncs the stage and writes the intent log
+	   from here on the update is bound to happen - a crash replays it */
+	inline void
+	prepare()
+	{
+		if (m_logged)
+			return;
+		std::sort(m_put.begin(), m_put.end());
+		for (size_t i = 1; i < m_put.size(); i++)
+			if (m_put[i - 1].first == m_put[i].first)
+				throw std::runtime_error("");
+		std::set<std::string> gone;
+		const auto displace = [&](const std::string &rel) {
+			gone.insert(rel);
+			m_ops.push_back(PsApplyOp{ 'D', 0, "d" + std::to_string(m_ops.size()), rel });
+		};
+		for (const auto &[rel, s] : m_put) {
+			// the first ancestor that is not a directory is in the way, unless it is gone already
+			bool clear = false;
+			std::string p;
+			for (const auto &c : boost::filesystem::path(rel).parent_path()) {
+				p += (p.empty() ? "" : "/") + c.generic_string();
+				if ((clear = gone.count(p) || !boost::filesystem::exists(boost::filesystem::symlink_status(m_root / p))))
+					break;
+				if (!boost::filesystem::is_directory(boost::filesystem::symlink_status(m_root / p))) {
+					displace(p);
+					clear = true;
+					break;
+				}
+			}
+			const auto st = boost::filesystem::symlink_status(m_root / rel);
+			char kind = 'N';
+			if (!clear && boost::filesystem::is_directory(st))
+				displace(rel);
+			else if (!clear && boost::filesystem::exists(st))
+				kind = 'X';
+			m_ops.push_back(PsApplyOp{ kind, _lstat_ino(m_stage / s), s, rel });
+		}
+
+		std::vector<boost::filesystem::path> staged = { m_stage };
+		for (const auto &[rel, s] : m_put)
+			staged.push_back(m_stage / s);
+		_sync_paths(staged);
+		_write_file_atomic(_apply_log_write(m_ops), _intent_path(m_root));
+		m_logged = true;
+	}
+
+	inline void
+	commit()
+	{
+		prepare();
+		_apply_run(m_root, m_ops, false);
+		m_done = true;
+	}
+
+	boost::filesystem::path m_root;
+	boost::filesystem::path m_stage;
+	std::vector<std::pair<std::string, std::string> > m_put;
+	std::vector<PsApplyOp> m_ops;
+	bool m_logged;
+	bool m_done;
+};
+
+#endif /* _PSAPPLY_HPP_ */
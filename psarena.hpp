@@ -0,0 +1,148 @@
+#ifndef _PSARENA_HPP_
+#define _PSARENA_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/* bump allocator - bytes are handed out from large blocks and released all at once (clear or destruction)
+   requests larger than a block get a block of their own */
+class PsArena
+{
+public:
+	inline static const size_t s_block = 256 * 1024;
+
+	inline PsArena() :
+		m_blk(),
+		m_cur(nullptr),
+		m_left(0),
+		m_nbyte(0)
+	{}
+
+	PsArena(const PsArena &) = delete;
+	PsArena &operator=(const PsArena &) = delete;
+
+	inline char *
+	alloc(size_t len)
+	{
+		if (len > m_left) {
+			const size_t siz = len > s_block ? len : s_block;
+			m_blk.push_back(std::make_unique<char[]>(siz));
+			m_nbyte += siz;
+			if (siz != s_block)
+				return m_blk.back().get();
+			m_cur = m_blk.back().get();
+			m_left = siz;
+		}
+		char *p = m_cur;
+		m_cur += len;
+		m_left -= len;
+		return p;
+	}
+
+	inline void
+	clear()
+	{
+		m_blk.clear();
+		m_cur = nullptr;
+		m_left = 0;
+		m_nbyte = 0;
+	}
+
+	/* bytes held in blocks */
+	inline size_t nbyte() const { return m_nbyte; }
+
+	std::vector<std::unique_ptr<char[]> > m_blk;
+	char *m_cur;
+	size_t m_left;
+	size_t m_nbyte;
+};
+
+/* the strings (relative paths) of one update session, interned once into an arena and referred to by 32-bit ids
+   equal strings share an id, views returned by str stay valid until clear or destruction
+   interning is not thread-safe, reading ids is */
+class PsStrPool
+{
+public:
+	using id_t = uint32_t;
+	inline static const id_t s_none = UINT32_MAX;
+
+	inline PsStrPool() :
+		m_arena(),
+		m_str(),
+		m_mask(15),
+		m_slot(16, s_none)
+	{}
+
+	PsStrPool(const PsStrPool &) = delete;
+	PsStrPool &operator=(const PsStrPool &) = delete;
+
+	inline size_t size() const { return m_str.size(); }
+	inline std::string_view str(id_t id) const { return m_str[id]; }
+	inline boost::filesystem::path path(id_t id) const { return boost::filesystem::path(m_str[id].begin(), m_str[id].end()); }
+
+	/* id of s, or s_none */
+	inline id_t
+	find(std::string_view s) const
+	{
+		return m_slot[_probe(s)];
+	}
+
+	inline id_t
+	intern(std::string_view s)
+	{
+		if (const size_t i = _probe(s); m_slot[i] != s_none)
+			return m_slot[i];
+		if (m_str.size() >= s_none - 1)
+			throw std::runtime_error("");
+		char *p = m_arena.alloc(s.size());
+		memcpy(p, s.data(), s.size());
+		const id_t id = (id_t) m_str.size();
+		m_str.push_back(std::string_view(p, s.size()));
+		if (2 * m_str.size() > m_slot.size())
+			_grow();
+		else
+			m_slot[_probe(s)] = id;
+		return id;
+	}
+
+	inline void
+	clear()
+	{
+		m_arena.clear();
+		m_str.clear();
+		m_mask = 15;
+		m_slot.assign(16, s_none);
+	}
+
+	/* slot holding s, or the empty slot where s would go */
+	inline size_t
+	_probe(std::string_view s) const
+	{
+		for (size_t i = std::hash<std::string_view>()(s) & m_mask;; i = (i + 1) & m_mask)
+			if (m_slot[i] == s_none || m_str[m_slot[i]] == s)
+				return i;
+	}
+
+	inline void
+	_grow()
+	{
+		m_mask = m_mask * 2 + 1;
+		m_slot.assign(m_mask + 1, s_none);
+		for (id_t id = 0; id < m_str.size(); id++)
+			m_slot[_probe(m_str[id])] = id;
+	}
+
+	PsArena m_arena;
+	std::vector<std::string_view> m_str;
+	size_t m_mask;
+	std::vector<id_t> m_slot;
+};
+
+#endif /* _PSARENA_HPP_ */
@@ -0,0 +1,175 @@
+#ifndef _PSCACHE_HPP_
+#define _PSCACHE_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+#include <psfs.hpp>
+
+/* persistent hash cache - maps a relative path plus its (size, mtime, ctime, inode) to the file checksum
+   file layout (host byte order, the index is local to the install):
+     "PSHC" u32:version i64:stamp_ns u64:count
+     count * { u32:pathlen char[pathlen]:path u64:size i64:mtime_ns i64:ctime_ns u64:ino u8:link u8[32]:sha }
+     u8[32]:sha256 of all the preceding bytes
+   a missing, truncated or otherwise corrupt file reads as an empty cache */
+class PsHashCache
+{
+public:
+	inline static const char s_magic[4] = { 'P', 'S', 'H', 'C' };
+	inline static const uint32_t s_version = 2;
+	/* entries modified this close to (or after) the start of the scan that wrote the cache are not trusted:
+	   a same-size rewrite within the filesystem timestamp granularity would go unnoticed */
+	inline static const int64_t s_racy_ns = 1000000000;
+
+	class Ent
+	{
+	public:
+		PsStat m_st;
+		ps_sha_t m_sha;
+	};
+
+	inline PsHashCache(const boost::filesystem::path &cachefile) :
+		m_cachefile(cachefile),
+		m_stamp_ns(0),
+		m_old(),
+		m_new()
+	{
+		if (boost::filesystem::is_regular_file(m_cachefile))
+			if (!_load(_readfile(m_cachefile)))
+				m_old.clear();
+	}
+
+	inline bool
+	lookup(std::string_view relpath, const PsStat &st, ps_sha_t &sha) const
+	{
+		auto it = m_old.find(relpath);
+		if (it == m_old.end() || it->second.m_st != st)
+			return false;
+		if (st.m_mtime_ns >= m_stamp_ns - s_racy_ns || st.m_ctime_ns >= m_stamp_ns - s_racy_ns)
+			return false;
+		sha = it->second.m_sha;
+		return true;
+	}
+
+	inline void
+	insert(std::string_view relpath, const PsStat &st, const ps_sha_t &sha)
+	{
+		m_new.insert_or_assign(std::string(relpath), Ent{ st, sha });
+	}
+
+	/* replaces the on-disk cache with the entries inserted since construction
+	   stamp_ns is the time the scan producing the entries started (see _now_ns) */
+	inline void
+	save(int64_t stamp_ns)
+	{
+		std::string buf;
+		buf.append(s_magic, sizeof s_magic);
+		_put(buf, s_version);
+		_put(buf, stamp_ns);
+		_put(buf, (uint64_t) m_new.size());
+		for (const auto &[k, v] : m_new) {
+			_put(buf, (uint32_t) k.size());
+			buf.append(k);
+			_put(buf, v.m_st.m_size);
+			_put(buf, v.m_st.m_mtime_ns);
+			_put(buf, v.m_st.m_ctime_ns);
+			_put(buf, v.m_st.m_ino);
+			_put(buf, (uint8_t) v.m_st.m_link);
+			_put(buf, v.m_sha);
+		}
+		PsSha256 tail;
+		tail.update(buf.data(), buf.size());
+		buf.append(tail.finish_bin());
+		boost::filesystem::create_directories(m_cachefile.parent_path());
+		_write_file_atomic(buf, m_cachefile);
+	}
+
+	template<typename T>
+	inline static void
+	_put(std::string &buf, const T &v)
+	{
+		buf.append((const char *) &v, sizeof v);
+	}
+
+	template<typename T>
+	inline static bool
+	_get(const std::string &buf, size_t &off, T &v)
+	{
+		if (buf.size() - off < sizeof v)
+			return false;
+		memcpy(&v, buf.data() + off, sizeof v);
+		off += sizeof v;
+		return true;
+	}
+
+	inline bool
+	_load(const std::string &buf)
+	{
+		if (buf.size() < sizeof s_magic + 32 || memcmp(buf.data(), s_magic, sizeof s_magic) != 0)
+			return false;
+		PsSha256 tail;
+		tail.update(buf.data(), buf.size() - 32);
+		if (tail.finish_bin() != buf.substr(buf.size() - 32))
+			return false;
+		const std::string body = buf.substr(0, buf.size() - 32);
+		size_t off = sizeof s_magic;
+		uint32_t version = 0;
+		uint64_t count = 0;
+		if (!_get(body, off, version) || version != s_version || !_get(body, off, m_stamp_ns) || !_get(body, off, count))
+			return false;
+		for (uint64_t i = 0; i < count; i++) {
+			uint32_t len = 0;
+			Ent ent;
+			if (!_get(body, off, len) || body.size() - off < len)
+				return false;
+			std::string k = body.substr(off, len);
+			off += len;
+			if (!_get(body, off, ent.m_st.m_size) || !_get(body, off, ent.m_st.m_mtime_ns) || !_get(body, off, ent.m_st.m_ctime_ns) || !_get(body, off, ent.m_st.m_ino))
+				return false;
+			uint8_t link = 0;
+			if (!_get(body, off, link) || !_get(body, off, ent.m_sha))
+				return false;
+			ent.m_st.m_link = link;
+			m_old.emplace(std::move(k), std::move(ent));
+		}
+		return off == body.size();
+	}
+
+	inline static std::string
+	_readfile(const boost::filesystem::path &path)
+	{
+		std::string buf(boost::filesystem::file_size(path), '\0');
+		boost::filesystem::ifstream ifst = boost::filesystem::ifstream(path, std::ios_base::in | std::ios_base::binary);
+		if (!ifst.read(&buf[0], buf.size()))
+			return std::string();
+		return buf;
+	}
+
+	boost::filesystem::path m_cachefile;
+	int64_t m_stamp_ns;
+	std::map<std::string, Ent, std::less<> > m_old;
+	std::map<std::string, Ent, std::less<> > m_new;
+};
+
+inline int64_t
+_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline boost::filesystem::path
+_hashcache_path(const boost::filesystem::path &ourroot)
+{
+	return _statedir(ourroot) / "hashcache.pshc";
+}
+
+#endif /* _PSCACHE_HPP_ */
@@ -0,0 +1,127 @@
+#ifndef _PSCDC_HPP_
+#define _PSCDC_HPP_
+
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+
+class PsChunk
+{
+public:
+	uint64_t m_off;
+	uint64_t m_len;
+	ps_sha_t m_sha;
+};
+
+/* content-defined chunker (gear rolling hash)
+   a boundary is placed where the top 16 bits of the rolling hash are zero, which depends only on the last 64 bytes -
+   an insertion or deletion therefore only moves the boundaries near it, chunks further along keep their checksums
+   chunk lengths are kept within [s_min, s_max], averaging about s_min + 64k */
+class PsCdc
+{
+public:
+	inline static const uint64_t s_min = 16 * 1024;
+	inline static const uint64_t s_max = 256 * 1024;
+
+	inline PsCdc() :
+		m_h(0),
+		m_off(0),
+		m_len(0),
+		m_sha()
+	{}
+
+	inline static const std::array<uint64_t, 256> &
+	_gear()
+	{
+		static const std::array<uint64_t, 256> gear = []() {
+			std::array<uint64_t, 256> g = {};
+			uint64_t x = 0x7073636463676561ULL;
+			for (auto &v : g) {
+				// splitmix64
+				uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+				v = z ^ (z >> 31);
+			}
+			return g;
+		}();
+		return gear;
+	}
+
+	inline void
+	update(const void *data, size_t len, std::vector<PsChunk> &out)
+	{
+		const unsigned char *p = (const unsigned char *) data;
+		const auto &gear = _gear();
+		size_t beg = 0;
+		for (size_t i = 0; i < len; i++) {
+			m_h = (m_h << 1) + gear[p[i]];
+			if (++m_len >= s_max || (m_len >= s_min && !(m_h >> 48))) {
+				m_sha.update(p + beg, i + 1 - beg);
+				_emit(out);
+				beg = i + 1;
+			}
+		}
+		m_sha.update(p + beg, len - beg);
+	}
+
+	inline void
+	finish(std::vector<PsChunk> &out)
+	{
+		if (m_len)
+			_emit(out);
+	}
+
+	inline void
+	_emit(std::vector<PsChunk> &out)
+	{
+		out.push_back(PsChunk{ m_off, m_len, m_sha.finish() });
+		m_off += m_len;
+		m_h = 0;
+		m_len = 0;
+		m_sha = PsSha256();
+	}
+
+	uint64_t m_h;
+	uint64_t m_off;
+	uint64_t m_len;
+	PsSha256 m_sha;
+};
+
+inline std::vector<PsChunk>
+_data_chunks(const std::string &data)
+{
+	std::vector<PsChunk> chunks;
+	PsCdc cdc;
+	cdc.update(data.data(), data.size(), chunks);
+	cdc.finish(chunks);
+	return chunks;
+}
+
+inline std::vector<PsChunk>
+_fname_chunks(const boost::filesystem::path &file)
+{
+	std::vector<PsChunk> chunks;
+	std::vector<char> buf(1024 * 1024);
+	boost::filesystem::ifstream ifst = boost::filesystem::ifstream(file, std::ios_base::in | std::ios_base::binary);
+	if (!ifst.is_open())
+		throw std::runtime_error("");
+	PsCdc cdc;
+	bool pending_end = false;
+	do {
+		if ((pending_end = !ifst.read(buf.data(), buf.size())); ifst.gcount())
+			cdc.update(buf.data(), ifst.gcount(), chunks);
+	} while (!pending_end);
+	if (!ifst.eof())
+		throw std::runtime_error("");
+	cdc.finish(chunks);
+	return chunks;
+}
+
+#endif /* _PSCDC_HPP_ */
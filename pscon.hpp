@@ -2,10 +2,17 @@
 #define _PSCON_HPP_
 
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <set>
 #include <string>
 #include <thread>
@@ -19,6 +26,10 @@
 #include <boost/regex.hpp>
 #include <boost/thread/barrier.hpp>
 
+#include <hasher.hpp>
+#include <pslimit.hpp>
+#include <pszip.hpp>
+
 using tcp = ::boost::asio::ip::tcp;
 namespace http = ::boost::beast::http;
 
@@ -111,7 +122,7 @@ _read_oneshot_timeout(boost::asio::io_service &serv, tcp::socket &sock, size_t t
 }
 
 inline std::string
-_accept_oneshot_http(const std::string &strport, size_t timo_ms, boost::barrier &bar_listen)
+_accept_oneshot_http(const std::string &strport, size_t timo_ms, boost::barrier &bar_listen, const std::string &resp_http = "HTTP/1.1 200 OK\r\n\r\n")
 {
 	boost::asio::io_service serv;
 	tcp::endpoint endp(tcp::v4(), (unsigned short)(std::stoi(strport)));
@@ -124,7 +135,7 @@ _accept_oneshot_http(const std::string &strport, size_t timo_ms, boost::barrier
 
 	std::string resp = _read_oneshot_timeout(serv, sock, timo_ms);
 
-	boost::asio::write(sock, boost::asio::buffer("HTTP/1.1 200 OK\r\n\r\n"), boost::asio::transfer_all());
+	boost::asio::write(sock, boost::asio::buffer(resp_http), boost::asio::transfer_all());
 
 	sock.close();
 
@@ -148,13 +159,200 @@ public:
 	inline virtual ~PsCon() {};
 	inline virtual res_t req(const std::string &path, const std::string &data) = 0;
 
+	/* a new independent connection to the same source, for use from another thread - nullptr if not supported */
+	inline virtual std::unique_ptr<PsCon>
+	clone()
+	{
+		return nullptr;
+	}
+
+	/* body restricted to bytes [off, off + len) of path - the default fetches the whole body and slices it */
+	inline virtual res_t
+	req_range(const std::string &path, const std::string &data, uint64_t off, uint64_t len)
+	{
+		res_t res = req(path, data);
+		if (off > res.body().size() || len > res.body().size() - off)
+			throw std::runtime_error("");
+		res.body() = res.body().substr(off, len);
+		return res;
+	}
+
+	/* body of path written to file dst, checksummed on the way - returns the checksum
+	   the default holds the whole body in memory, implementations stream it through a fixed size buffer */
+	inline virtual ps_sha_t
+	req_file(const std::string &path, const std::string &data, const boost::filesystem::path &dst)
+	{
+		return _req_file_write(req(path, data).body(), dst);
+	}
+
+	inline static ps_sha_t
+	_req_file_write(const std::string &body, const boost::filesystem::path &dst)
+	{
+		PsSha256 sha;
+		sha.update(body.data(), body.size());
+		boost::filesystem::ofstream ofst = boost::filesystem::ofstream(dst, std::ios_base::out | std::ios_base::binary);
+		if (!ofst.write(body.data(), body.size()))
+			throw std::runtime_error("");
+		return sha.finish();
+	}
+
+	/* req_file continuing a download - dst holds the first sha.m_len bytes of path (sha the hash state over them),
+	   fetched from the version of path named by validator
+	   the rest is appended to dst and fed to sha, a source that can not continue (another version, no validator)
+	   starts over, resetting sha and truncating dst
+	   on return validator names the version received ("" - unknown, the download can not be continued),
+	   ckpt() is called after every m_ckpt bytes with dst flushed up to sha.m_len
+	   the default fetches the whole body through req, without checkpoints */
+	inline virtual void
+	req_file_resume(const std::string &path, const std::string &data, const boost::filesystem::path &dst, PsSha256 &sha, std::string &validator, const std::function<void()> &/*ckpt*/)
+	{
+		const std::string body = req(path, data).body();
+		sha = PsSha256();
+		sha.update(body.data(), body.size());
+		validator.clear();
+		boost::filesystem::ofstream ofst = boost::filesystem::ofstream(dst, std::ios_base::out | std::ios_base::binary);
+		if (!ofst.write(body.data(), body.size()))
+			throw std::runtime_error("");
+	}
+
+	/* dst opened for appending after its first off bytes, or truncated when off is 0 (starting over) */
+	inline static boost::filesystem::ofstream
+	_req_file_open(const boost::filesystem::path &dst, uint64_t off)
+	{
+		return boost::filesystem::ofstream(dst, std::ios_base::out | std::ios_base::binary | (off ? std::ios_base::app : std::ios_base::trunc));
+	}
+
+	/* asynchronous req - completes with (std::exception_ptr, res_t) through any asio completion token
+	   (callback, boost::asio::use_future, boost::asio::use_awaitable under C++20, ...)
+	   the work runs on the io_context given to set_io_context, which the caller keeps running */
+	template<typename CompletionToken>
+	inline auto
+	async_req(const std::string &path, const std::string &data, CompletionToken &&token)
+	{
+		return boost::asio::async_initiate<CompletionToken, void(std::exception_ptr, res_t)>(
+			[this](auto handler, const std::string &path, const std::string &data) {
+				using handler_t = decltype(handler);
+				auto work = boost::asio::make_work_guard(boost::asio::get_associated_executor(handler, _aioc().get_executor()));
+				auto h = std::make_shared<std::pair<handler_t, decltype(work)> >(std::move(handler), std::move(work));
+				_async_req(path, data, [h](std::exception_ptr e, res_t res) {
+					auto ex = h->second.get_executor();
+					boost::asio::dispatch(ex, [h, e, res = std::move(res)]() mutable {
+						h->second.reset();
+						h->first(e, std::move(res));
+					});
+				});
+			}, token, path, data);
+	}
+
+	inline void
+	set_io_context(boost::asio::io_context &ioc)
+	{
+		m_aioc = &ioc;
+	}
+
+	inline boost::asio::io_context &
+	_aioc()
+	{
+		if (!m_aioc)
+			throw std::runtime_error("");
+		return *m_aioc;
+	}
+
+	/* the default runs the blocking req as a task on the io_context */
+	inline virtual void
+	_async_req(const std::string &path, const std::string &data, const std::function<void(std::exception_ptr, res_t)> &cb)
+	{
+		boost::asio::post(_aioc(), [this, path, data, cb]() {
+			res_t res;
+			try {
+				res = req(path, data);
+			}
+			catch (...) {
+				return cb(std::current_exception(), res_t());
+			}
+			cb(nullptr, std::move(res));
+		});
+	}
+
 public:
 	ConProgress m_prog;
+	boost::asio::io_context *m_aioc = nullptr;
+	/* req and req_file try the pre-compressed sibling of a path in this coding first (see _dir_mkcompressed),
+	   falling back to the path itself where there is none */
+	ps_enc_t m_zsib = ps_enc_t::Identity;
+	/* bytes between two req_file_resume checkpoints */
+	uint64_t m_ckpt = 8 * 1024 * 1024;
+	/* throttle of the synchronous requests (nullptr - unthrottled), charged in m_prio as bytes arrive - every body
+	   is read in 64k pieces, each charged before the next is read (clones get PsLimit::fork) */
+	std::shared_ptr<PsLimit> m_limit;
+	std::atomic<ps_prio_t> m_prio = ps_prio_t::Normal;
+
+	inline void
+	_pace(uint64_t n)
+	{
+		if (m_limit)
+			m_limit->take(n, m_prio);
+	}
 };
 
+/* HTTP/1.1 client - synchronous requests check a connection out of a pool of up to m_pool (callers on several threads
+   get one each, a caller finding none idle and the pool full waits), back into it after a kept-alive answer
+     connections idle for more than m_idle_ms are closed rather than reused, the server has likely dropped them
+     a reused connection failing before any answer is retried once on a fresh one
+     every connect / read / write must complete within m_timeout_ms, a whole request within m_deadline_ms
+     (0 - unbounded), an expiry closes the connection and throws timed_out
+     sockets get TCP_NODELAY, and m_rcvbuf / m_sndbuf as SO_RCVBUF / SO_SNDBUF when set (0 - the kernel's
+     autotuning, which a fixed size disables)
+   the host name is resolved again when no resolved address accepts a connection */
 class PsConNet : public PsCon
 {
 public:
+	/* a pooled connection - with its own io_context, so requests on different connections run on their callers' threads */
+	class Conn
+	{
+	public:
+		inline Conn() :
+			m_ioc(),
+			m_sock(m_ioc),
+			m_timer(m_ioc),
+			m_used(),
+			m_deadline(std::chrono::steady_clock::time_point::max()),
+			m_nreq(0)
+		{}
+
+		boost::asio::io_context m_ioc;
+		tcp::socket m_sock;
+		boost::asio::steady_timer m_timer;
+		std::chrono::steady_clock::time_point m_used;
+		std::chrono::steady_clock::time_point m_deadline;
+		size_t m_nreq;
+	};
+
+	/* a connection checked out for one request - back into the pool if m_keep is set by then, closed otherwise */
+	class Lease
+	{
+	public:
+		inline Lease(PsConNet &con, bool fresh = false) :
+			m_con(con),
+			m_c(con._conn_get(fresh)),
+			m_keep(false)
+		{
+			m_c->m_deadline = con.m_deadline_ms ? std::chrono::steady_clock::now() + std::chrono::milliseconds(con.m_deadline_ms) : std::chrono::steady_clock::time_point::max();
+		}
+
+		inline ~Lease()
+		{
+			m_con._conn_put(std::move(m_c), m_keep);
+		}
+
+		Lease(const Lease &) = delete;
+		Lease &operator=(const Lease &) = delete;
+
+		PsConNet &m_con;
+		std::unique_ptr<Conn> m_c;
+		bool m_keep;
+	};
+
 	inline PsConNet(const std::string &host, const std::string &port, const std::string &host_http_rootpath) :
 		PsCon(),
 		m_host(host),
@@ -164,21 +362,139 @@ public:
 		m_ioc(),
 		m_resolver(m_ioc),
 		m_resolver_r(m_resolver.resolve(host, port)),
-		m_socket(new tcp::socket(m_ioc))
+		m_pmtx(),
+		m_pcv(),
+		m_idle(),
+		m_nconn(0)
 	{
-		boost::asio::connect(*m_socket, m_resolver_r.begin(), m_resolver_r.end());
+		// connect eagerly - an unreachable server fails here rather than at the first request
+		Lease l(*this);
+		l.m_keep = true;
 	};
 
 	inline virtual ~PsConNet() override
 	{
-		m_socket->shutdown(tcp::socket::shutdown_both);
+		for (auto &c : m_idle) {
+			boost::system::error_code ec;
+			c->m_sock.shutdown(tcp::socket::shutdown_both, ec);
+		}
 	}
 
 	inline void
-	_reconnect()
+	_sockopt(tcp::socket &sock)
+	{
+		boost::system::error_code ec;
+		sock.set_option(tcp::no_delay(true), ec);
+		if (m_rcvbuf)
+			sock.set_option(boost::asio::socket_base::receive_buffer_size((int) m_rcvbuf), ec);
+		if (m_sndbuf)
+			sock.set_option(boost::asio::socket_base::send_buffer_size((int) m_sndbuf), ec);
+	}
+
+	/* runs the asynchronous operation op(handler) on c to completion - timed_out once m_timeout_ms or the deadline of
+	   the request passes, the socket is closed then */
+	template<typename Op>
+	inline boost::system::error_code
+	_run(Conn &c, Op op)
 	{
-		m_socket.reset(new tcp::socket(m_ioc));
-		boost::asio::connect(*m_socket, m_resolver_r.begin(), m_resolver_r.end());
+		bool done = false, fired = false;
+		boost::system::error_code ec;
+		const auto now = std::chrono::steady_clock::now();
+		const auto until = std::min(m_timeout_ms ? now + std::chrono::milliseconds(m_timeout_ms) : std::chrono::steady_clock::time_point::max(), c.m_deadline);
+		if (until != std::chrono::steady_clock::time_point::max()) {
+			c.m_timer.expires_at(until);
+			c.m_timer.async_wait([&](const boost::system::error_code &e) {
+				if (e || done)
+					return;
+				fired = true;
+				boost::system::error_code ec_;
+				c.m_sock.close(ec_);
+			});
+		}
+		op([&](const boost::system::error_code &e) {
+			done = true;
+			ec = e;
+			c.m_timer.cancel();
+		});
+		c.m_ioc.restart();
+		c.m_ioc.run();
+		return fired ? boost::system::error_code(boost::asio::error::timed_out) : ec;
+	}
+
+	inline std::unique_ptr<Conn>
+	_connect()
+	{
+		auto c = std::make_unique<Conn>();
+		for (size_t pass = 0; pass < 2; pass++) {
+			tcp::resolver::results_type r;
+			{
+				std::lock_guard<std::mutex> l(m_pmtx);
+				if (pass)
+					m_resolver_r = m_resolver.resolve(m_host, m_port);
+				r = m_resolver_r;
+			}
+			for (const auto &ep : r) {
+				boost::system::error_code ec;
+				c->m_sock.close(ec);
+				if (c->m_sock.open(ep.endpoint().protocol(), ec))
+					continue;
+				_sockopt(c->m_sock);
+				if (!_run(*c, [&](auto h) { c->m_sock.async_connect(ep.endpoint(), h); }))
+					return c;
+			}
+		}
+		throw std::runtime_error("");
+	}
+
+	/* an idle connection (none with fresh), a new one while the pool has room, else waits for one to be returned */
+	inline std::unique_ptr<Conn>
+	_conn_get(bool fresh = false)
+	{
+		std::unique_lock<std::mutex> l(m_pmtx);
+		for (;;) {
+			const auto old = std::chrono::steady_clock::now() - std::chrono::milliseconds(m_idle_ms);
+			for (auto it = m_idle.begin(); it != m_idle.end();) {
+				if ((*it)->m_used < old || fresh) {
+					it = m_idle.erase(it);
+					m_nconn--;
+				}
+				else
+					++it;
+			}
+			if (m_idle.size()) {
+				std::unique_ptr<Conn> c = std::move(m_idle.back());
+				m_idle.pop_back();
+				return c;
+			}
+			if (m_nconn < std::max<size_t>(m_pool, 1))
+				break;
+			m_pcv.wait(l);
+		}
+		m_nconn++;
+		l.unlock();
+		try {
+			return _connect();
+		}
+		catch (...) {
+			l.lock();
+			m_nconn--;
+			m_pcv.notify_one();
+			throw;
+		}
+	}
+
+	inline void
+	_conn_put(std::unique_ptr<Conn> c, bool keep)
+	{
+		std::lock_guard<std::mutex> l(m_pmtx);
+		if (keep && c->m_sock.is_open()) {
+			c->m_used = std::chrono::steady_clock::now();
+			c->m_nreq++;
+			m_idle.push_back(std::move(c));
+		}
+		else
+			m_nconn--;
+		m_pcv.notify_one();
 	}
 
 	inline static std::string
@@ -192,25 +508,95 @@ public:
 		return rootpath + path;
 	}
 
-	inline res_t
-	req_(const http::verb &verb, const std::string &path, const std::string &data)
+	/* accept - offer the content codings this build decodes
+	   if_range - the range applies only while path is still this version, otherwise the answer is the whole body */
+	inline void
+	_write_req(Conn &c, const http::verb &verb, const std::string &path, const std::string &range, bool accept = false, const std::string &if_range = std::string())
 	{
 		http::request<http::string_body> req(verb, _joinpath(m_host_http_rootpath, path), 11);
 		req.set(http::field::host, m_host_http);
 		req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
-		http::write(*m_socket, req);
-		boost::beast::flat_buffer buffer;
-		http::response<http::string_body> res;
-		http::read(*m_socket, buffer, res);
+		if (range.size())
+			req.set(http::field::range, range);
+		if (if_range.size())
+			req.set(http::field::if_range, if_range);
+		if (accept)
+			req.set(http::field::accept_encoding, _enc_accept());
+		if (const auto ec = _run(c, [&](auto h) { http::async_write(c.m_sock, req, [h](const boost::system::error_code &e, size_t) { h(e); }); }))
+			throw boost::system::system_error(ec);
+	}
+
+	/* sends the request and reads the answer header into parser - retried once on a fresh connection when a reused
+	   one fails (the server closed it while idle) */
+	template<typename P, typename W>
+	inline void
+	_req_head(std::optional<Lease> &lease, boost::beast::flat_buffer &buffer, std::optional<P> &parser, W write)
+	{
+		for (size_t attempt = 0;; attempt++) {
+			lease.reset();
+			lease.emplace(*this, attempt > 0);
+			Conn &c = *lease->m_c;
+			const bool reused = c.m_nreq > 0;
+			buffer.clear();
+			parser.emplace();
+			parser->body_limit(std::numeric_limits<uint64_t>::max());
+			try {
+				write(c);
+				if (const auto ec = _run(c, [&](auto h) { http::async_read_header(c.m_sock, buffer, *parser, [h](const boost::system::error_code &e, size_t) { h(e); }); }))
+					throw boost::system::system_error(ec);
+				return;
+			}
+			catch (boost::system::system_error &e) {
+				if (!reused || attempt || e.code() == boost::asio::error::timed_out)
+					throw;
+			}
+		}
+	}
+
+	/* reads the rest of the body of the answer whose header parser holds through a fixed 64k buffer, handing each
+	   piece to sink once it is paced */
+	inline void
+	_read_body(Lease &lease, boost::beast::flat_buffer &buffer, http::response_parser<http::buffer_body> &parser, const std::function<void(const char *, size_t)> &sink)
+	{
+		Conn &c = *lease.m_c;
+		std::unique_ptr<char[]> buf(new char[64 * 1024]);
+		while (!parser.is_done()) {
+			parser.get().body().data = buf.get();
+			parser.get().body().size = 64 * 1024;
+			const auto ec = _run(c, [&](auto h) { http::async_read(c.m_sock, buffer, parser, [h](const boost::system::error_code &e, size_t) { h(e); }); });
+			if (ec && ec != http::error::need_buffer)
+				throw boost::system::system_error(ec);
+			_pace(64 * 1024 - parser.get().body().size);
+			sink(buf.get(), 64 * 1024 - parser.get().body().size);
+		}
 		// https://github.com/boostorg/beast/issues/927
 		//   Repeated calls to an URL (repeated http::write calls without remaking the socket)
 		//     - needs http::response::keep_alive() true
 		//     - (for which http::response::version() must be 11 (HTTP 1.1))
 		// https://www.reddit.com/r/flask/comments/634i5u/make_flask_return_header_response_with_http11/
 		//   You can't. Flask's dev server does not implement the HTTP 1.1 spec
-		//     - flask does not support HTTP 1.1, remake socket if necessary
-		if (!res.keep_alive())
-			_reconnect();
+		//     - flask does not support HTTP 1.1, the connection is not returned to the pool then
+		lease.m_keep = parser.get().keep_alive();
+	}
+
+	/* whole requests (no range, no sibling) accept compressed answers, a 200 body comes back decoded
+	   sib - fetch the pre-compressed sibling of path in that coding instead */
+	inline res_t
+	req_(const http::verb &verb, const std::string &path, const std::string &data, const std::string &range = std::string(), ps_enc_t sib = ps_enc_t::Identity)
+	{
+		std::optional<Lease> lease;
+		boost::beast::flat_buffer buffer;
+		std::optional<http::response_parser<http::buffer_body> > parser;
+		_req_head(lease, buffer, parser, [&](Conn &c) { _write_req(c, verb, _enc_sib(path, sib), range, range.empty() && sib == ps_enc_t::Identity); });
+		std::string body;
+		_read_body(*lease, buffer, *parser, [&](const char *p, size_t n) { body.append(p, n); });
+		res_t res(std::move(parser->get().base()), std::move(body));
+		if (res.result_int() == 200) {
+			if (const ps_enc_t enc = sib != ps_enc_t::Identity ? sib : _enc_parse(res[http::field::content_encoding].to_string()); enc != ps_enc_t::Identity) {
+				res.body() = _enc_decode(enc, res.body());
+				res.erase(http::field::content_encoding);
+			}
+		}
 		return res;
 	}
 
@@ -218,12 +604,222 @@ public:
 	req(const std::string &path, const std::string &data) override
 	{
 		m_prog.onRequest(path, data);
+		if (m_zsib != ps_enc_t::Identity)
+			if (res_t res = req_(http::verb::get, path, data, std::string(), m_zsib); res.result_int() == 200)
+				return res;
 		res_t res = req_(http::verb::get, path, data);
 		if (res.result_int() != 200)
 			throw std::runtime_error("");
 		return res;
 	}
 
+	inline virtual std::unique_ptr<PsCon>
+	clone() override
+	{
+		auto c = std::make_unique<PsConNet>(m_host, m_port, m_host_http_rootpath);
+		c->m_zsib = m_zsib;
+		c->m_ckpt = m_ckpt;
+		c->m_pool = m_pool;
+		c->m_idle_ms = m_idle_ms;
+		c->m_timeout_ms = m_timeout_ms;
+		c->m_deadline_ms = m_deadline_ms;
+		c->m_rcvbuf = m_rcvbuf;
+		c->m_sndbuf = m_sndbuf;
+		c->m_limit = m_limit ? m_limit->fork() : nullptr;
+		c->m_prio = m_prio.load();
+		return c;
+	}
+
+	/* the body is read into a fixed 64k buffer_body and written out piece by piece - peak memory does not grow with the body
+	   a compressed body (or sibling) is decoded on the way, dst and the checksum get the decoded content */
+	inline virtual ps_sha_t
+	req_file(const std::string &path, const std::string &data, const boost::filesystem::path &dst) override
+	{
+		PsSha256 sha;
+		std::string validator;
+		req_file_resume(path, data, dst, sha, validator, nullptr);
+		return sha.finish();
+	}
+
+	/* continues with Range: bytes=<sha.m_len>- and If-Range: <validator>, a 200 answer (path changed) starts over
+	   the validator is the strong ETag, else Last-Modified - a compressed body has none, its offsets are not the file's */
+	inline virtual void
+	req_file_resume(const std::string &path, const std::string &data, const boost::filesystem::path &dst, PsSha256 &sha, std::string &validator, const std::function<void()> &ckpt) override
+	{
+		m_prog.onRequest(path, data);
+		if (sha.m_len && validator.empty())
+			sha = PsSha256();
+		if (!sha.m_len && m_zsib != ps_enc_t::Identity && _req_file(path, dst, m_zsib, sha, validator, ckpt))
+			return;
+		if (_req_file(path, dst, ps_enc_t::Identity, sha, validator, ckpt))
+			return;
+		// 416 and the like - the partial content is of no use
+		if (!sha.m_len || (sha = PsSha256(), !_req_file(path, dst, ps_enc_t::Identity, sha, validator, ckpt)))
+			throw std::runtime_error("");
+	}
+
+	/* false on an answer other than 200 (or 206 when continuing) - its body is drained, keeping the connection */
+	inline bool
+	_req_file(const std::string &path, const boost::filesystem::path &dst, ps_enc_t sib, PsSha256 &sha, std::string &validator, const std::function<void()> &ckpt)
+	{
+		const uint64_t off = sha.m_len;
+		std::optional<Lease> lease;
+		boost::beast::flat_buffer buffer;
+		std::optional<http::response_parser<http::buffer_body> > parser;
+		_req_head(lease, buffer, parser, [&](Conn &c) {
+			if (off)
+				_write_req(c, http::verb::get, path, "bytes=" + std::to_string(off) + "-", false, validator);
+			else
+				_write_req(c, http::verb::get, _enc_sib(path, sib), std::string(), sib == ps_enc_t::Identity);
+		});
+		const auto read = [&](const std::function<void(const char *, size_t)> &sink) { _read_body(*lease, buffer, *parser, sink); };
+		const auto &res = parser->get();
+		const bool partial = off && res.result_int() == 206;
+		if (res.result_int() != 200 && !partial) {
+			read([](const char *, size_t) {});
+			return false;
+		}
+		if (partial && res[http::field::content_range].to_string().rfind("bytes " + std::to_string(off) + "-", 0) != 0)
+			throw std::runtime_error("");
+		PsInflate dec(sib != ps_enc_t::Identity ? sib : _enc_parse(res[http::field::content_encoding].to_string()));
+		if (partial && dec.m_enc != ps_enc_t::Identity)
+			throw std::runtime_error("");
+		if (!partial)
+			sha = PsSha256();
+		if (dec.m_enc != ps_enc_t::Identity)
+			validator.clear();
+		else if (const std::string etag = res[http::field::etag].to_string(); etag.size() && etag.rfind("W/", 0) != 0)
+			validator = etag;
+		else
+			validator = res[http::field::last_modified].to_string();
+		boost::filesystem::ofstream ofst = _req_file_open(dst, sha.m_len);
+		if (!ofst.is_open())
+			throw std::runtime_error("");
+		uint64_t next = sha.m_len + m_ckpt;
+		read([&](const char *p, size_t n) {
+			dec.update(p, n, [&](const unsigned char *q, size_t m) {
+				sha.update(q, m);
+				if (!ofst.write((const char *) q, m))
+					throw std::runtime_error("");
+			});
+			if (ckpt && validator.size() && sha.m_len >= next) {
+				if (!ofst.flush())
+					throw std::runtime_error("");
+				ckpt();
+				next = sha.m_len + m_ckpt;
+			}
+		});
+		dec.finish();
+		if (!ofst.flush())
+			throw std::runtime_error("");
+		return true;
+	}
+
+	inline virtual res_t
+	req_range(const std::string &path, const std::string &data, uint64_t off, uint64_t len) override
+	{
+		if (!len)
+			return res_t(http::status::ok, 11);
+		m_prog.onRequest(path, data);
+		res_t res = req_(http::verb::get, path, data, "bytes=" + std::to_string(off) + "-" + std::to_string(off + len - 1));
+		// a server ignoring Range answers 200 with the whole body
+		if (res.result_int() == 200 && off <= res.body().size() && len <= res.body().size() - off)
+			res.body() = res.body().substr(off, len);
+		else if (res.result_int() != 206 || res.body().size() != len)
+			throw std::runtime_error("");
+		return res;
+	}
+
+	/* asynchronous requests use their own connection on the shared io_context, one request at a time in
+	   submission order - all the m_a* state is only touched from m_astrand */
+	class AOp
+	{
+	public:
+		http::request<http::empty_body> m_req;
+		boost::beast::flat_buffer m_buf;
+		http::response_parser<http::string_body> m_parser;
+		std::function<void(std::exception_ptr, res_t)> m_cb;
+	};
+
+	inline virtual void
+	_async_req(const std::string &path, const std::string &data, const std::function<void(std::exception_ptr, res_t)> &cb) override
+	{
+		m_prog.onRequest(path, data);
+		std::call_once(m_aonce, [this]() { m_astrand.emplace(_aioc().get_executor()); });
+		auto op = std::make_shared<AOp>();
+		op->m_req = http::request<http::empty_body>(http::verb::get, _joinpath(m_host_http_rootpath, path), 11);
+		op->m_req.set(http::field::host, m_host_http);
+		op->m_req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+		op->m_req.set(http::field::accept_encoding, _enc_accept());
+		op->m_parser.body_limit(std::numeric_limits<uint64_t>::max());
+		op->m_cb = cb;
+		boost::asio::post(*m_astrand, [this, op]() {
+			m_aqueue.push_back(op);
+			if (m_aqueue.size() == 1)
+				_astart();
+		});
+	}
+
+	inline void
+	_astart()
+	{
+		auto op = m_aqueue.front();
+		if (m_asocket && m_asocket->is_open())
+			return _awrite(op);
+		m_asocket = std::make_shared<tcp::socket>(_aioc());
+		tcp::resolver::results_type r;
+		{
+			std::lock_guard<std::mutex> l(m_pmtx);
+			r = m_resolver_r;
+		}
+		boost::asio::async_connect(*m_asocket, r, boost::asio::bind_executor(*m_astrand, [this, op](const boost::system::error_code &ec, const tcp::endpoint &) {
+			if (ec)
+				return _adone(op, ec);
+			_sockopt(*m_asocket);
+			_awrite(op);
+		}));
+	}
+
+	inline void
+	_awrite(const std::shared_ptr<AOp> &op)
+	{
+		http::async_write(*m_asocket, op->m_req, boost::asio::bind_executor(*m_astrand, [this, op](const boost::system::error_code &ec, size_t) {
+			if (ec)
+				return _adone(op, ec);
+			http::async_read(*m_asocket, op->m_buf, op->m_parser, boost::asio::bind_executor(*m_astrand, [this, op](const boost::system::error_code &ec, size_t) {
+				_adone(op, ec);
+			}));
+		}));
+	}
+
+	inline void
+	_adone(const std::shared_ptr<AOp> &op, const boost::system::error_code &ec)
+	{
+		std::exception_ptr e;
+		res_t res;
+		if (ec)
+			e = std::make_exception_ptr(boost::system::system_error(ec));
+		else if ((res = op->m_parser.release()).result_int() != 200)
+			e = std::make_exception_ptr(std::runtime_error(""));
+		else if (res.count(http::field::content_encoding)) {
+			try {
+				res.body() = _enc_decode(_enc_parse(res[http::field::content_encoding].to_string()), res.body());
+				res.erase(http::field::content_encoding);
+			}
+			catch (...) {
+				e = std::current_exception();
+			}
+		}
+		if (ec || !res.keep_alive()) {
+			boost::system::error_code ec_;
+			m_asocket->close(ec_);
+		}
+		m_aqueue.pop_front();
+		if (!m_aqueue.empty())
+			_astart();
+		op->m_cb(e, std::move(res));
+	}
+
 	std::string m_host;
 	std::string m_port;
 	std::string m_host_http;
@@ -231,7 +827,21 @@ public:
 	boost::asio::io_context m_ioc;
 	tcp::resolver m_resolver;
 	tcp::resolver::results_type m_resolver_r;
-	std::shared_ptr<tcp::socket> m_socket;
+	std::mutex m_pmtx;
+	std::condition_variable m_pcv;
+	std::vector<std::unique_ptr<Conn> > m_idle;
+	size_t m_nconn;
+	/* pool size, idle eviction, per operation and per request timeouts (ms), socket buffer sizes - see above */
+	size_t m_pool = 4;
+	uint64_t m_idle_ms = 30000;
+	uint64_t m_timeout_ms = 30000;
+	uint64_t m_deadline_ms = 0;
+	size_t m_rcvbuf = 0;
+	size_t m_sndbuf = 0;
+	std::once_flag m_aonce;
+	std::optional<boost::asio::strand<boost::asio::io_context::executor_type> > m_astrand;
+	std::deque<std::shared_ptr<AOp> > m_aqueue;
+	std::shared_ptr<tcp::socket> m_asocket;
 };
 
 class PsConFs : public PsCon
@@ -249,11 +859,113 @@ public:
 	{
 	}
 
+	/* m_zsib if path has a sibling in that coding, Identity otherwise */
+	inline ps_enc_t
+	_sib(const std::string &path) const
+	{
+		if (m_zsib == ps_enc_t::Identity || !boost::filesystem::is_regular_file(m_rootdir / _enc_sib(path, m_zsib)))
+			return ps_enc_t::Identity;
+		return m_zsib;
+	}
+
+	/* len bytes of file from off, read in 64k pieces each paced before the next is read */
+	inline std::string
+	_read_paced(const boost::filesystem::path &file, uint64_t off, uint64_t len)
+	{
+		std::string body(len, '\0');
+		boost::filesystem::ifstream ifst = boost::filesystem::ifstream(file, std::ios_base::in | std::ios_base::binary);
+		if (!ifst.seekg(off))
+			throw std::runtime_error("");
+		for (uint64_t pos = 0; pos < len;) {
+			const size_t n = (size_t) std::min<uint64_t>(len - pos, 64 * 1024);
+			if (!ifst.read(&body[pos], n))
+				throw std::runtime_error("");
+			_pace(n);
+			pos += n;
+		}
+		return body;
+	}
+
 	inline virtual res_t
 	req(const std::string &path, const std::string &data) override
 	{
 		m_prog.onRequest(path, data);
-		return res_t(boost::beast::http::status::ok, 11, _readfile(m_rootdir / path));
+		const ps_enc_t sib = _sib(path);
+		const boost::filesystem::path file = m_rootdir / _enc_sib(path, sib);
+		const std::string body = _read_paced(file, 0, boost::filesystem::file_size(file));
+		return res_t(boost::beast::http::status::ok, 11, _enc_decode(sib, body));
+	}
+
+	inline virtual std::unique_ptr<PsCon>
+	clone() override
+	{
+		auto c = std::make_unique<PsConFs>(m_rootdir);
+		c->m_zsib = m_zsib;
+		c->m_ckpt = m_ckpt;
+		c->m_limit = m_limit ? m_limit->fork() : nullptr;
+		c->m_prio = m_prio.load();
+		return c;
+	}
+
+	inline virtual ps_sha_t
+	req_file(const std::string &path, const std::string &data, const boost::filesystem::path &dst) override
+	{
+		PsSha256 sha;
+		std::string validator;
+		req_file_resume(path, data, dst, sha, validator, nullptr);
+		return sha.finish();
+	}
+
+	/* the validator is "<size>-<mtime>" of the file, siblings are only read when starting from zero */
+	inline virtual void
+	req_file_resume(const std::string &path, const std::string &data, const boost::filesystem::path &dst, PsSha256 &sha, std::string &validator, const std::function<void()> &ckpt) override
+	{
+		m_prog.onRequest(path, data);
+		const boost::filesystem::path file = m_rootdir / path;
+		const std::string now = std::to_string(boost::filesystem::file_size(file)) + "-" + std::to_string(boost::filesystem::last_write_time(file));
+		if (sha.m_len && validator != now)
+			sha = PsSha256();
+		const ps_enc_t sib = sha.m_len ? ps_enc_t::Identity : _sib(path);
+		validator = sib == ps_enc_t::Identity ? now : std::string();
+		PsInflate dec(sib);
+		std::unique_ptr<char[]> buf(new char[64 * 1024]);
+		boost::filesystem::ifstream ifst = boost::filesystem::ifstream(m_rootdir / _enc_sib(path, sib), std::ios_base::in | std::ios_base::binary);
+		if (!ifst.is_open() || !ifst.seekg(sha.m_len))
+			throw std::runtime_error("");
+		boost::filesystem::ofstream ofst = _req_file_open(dst, sha.m_len);
+		if (!ofst.is_open())
+			throw std::runtime_error("");
+		const auto put = [&](const unsigned char *p, size_t n) {
+			sha.update(p, n);
+			if (!ofst.write((const char *) p, n))
+				throw std::runtime_error("");
+		};
+		uint64_t next = sha.m_len + m_ckpt;
+		bool pending_end = false;
+		do {
+			if ((pending_end = !ifst.read(buf.get(), 64 * 1024)); ifst.gcount()) {
+				_pace(ifst.gcount());
+				dec.update(buf.get(), ifst.gcount(), put);
+			}
+			if (ckpt && validator.size() && sha.m_len >= next) {
+				if (!ofst.flush())
+					throw std::runtime_error("");
+				ckpt();
+				next = sha.m_len + m_ckpt;
+			}
+		} while (!pending_end);
+		if (!ifst.eof())
+			throw std::runtime_error("");
+		dec.finish();
+		if (!ofst.flush())
+			throw std::runtime_error("");
+	}
+
+	inline virtual res_t
+	req_range(const std::string &path, const std::string &data, uint64_t off, uint64_t len) override
+	{
+		m_prog.onRequest(path, data);
+		return res_t(boost::beast::http::status::partial_content, 11, _read_paced(m_rootdir / path, off, len));
 	}
 
 	boost::filesystem::path m_rootdir;
@@ -0,0 +1,197 @@
+#ifndef _PSDIFF_HPP_
+#define _PSDIFF_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+#include <psarena.hpp>
+
+/* open-addressing (linear probing) checksum -> index table in one contiguous array
+   sized up front for n keys at most half full, there is no erase and no rehash */
+class PsShaTable
+{
+public:
+	inline static const uint32_t s_none = UINT32_MAX;
+
+	inline PsShaTable(size_t n) :
+		m_mask(0),
+		m_slot()
+	{
+		size_t cap = 16;
+		while (cap < 2 * n)
+			cap *= 2;
+		m_mask = cap - 1;
+		m_slot.resize(cap, std::make_pair(ps_sha_t(), s_none));
+	}
+
+	/* index stored for sha, or s_none */
+	inline uint32_t
+	find(const ps_sha_t &sha) const
+	{
+		for (size_t i = sha.hash() & m_mask;; i = (i + 1) & m_mask)
+			if (m_slot[i].second == s_none || m_slot[i].first == sha)
+				return m_slot[i].second;
+	}
+
+	/* stores idx for sha unless sha is already present - returns the index stored for sha either way */
+	inline uint32_t
+	insert(const ps_sha_t &sha, uint32_t idx)
+	{
+		for (size_t i = sha.hash() & m_mask;; i = (i + 1) & m_mask) {
+			if (m_slot[i].second == s_none) {
+				m_slot[i] = std::make_pair(sha, idx);
+				return idx;
+			}
+			if (m_slot[i].first == sha)
+				return m_slot[i].second;
+		}
+	}
+
+	size_t m_mask;
+	std::vector<std::pair<ps_sha_t, uint32_t> > m_slot;
+};
+
+/* the update plan turning the local tree (beg) into the goal tree, in terms of indices into the input vectors
+     m_keep    goal entries whose path already holds the goal content
+     m_move    (beg, goal) entries at the same path with differing content - beg is displaced before anything is copied
+     m_copy    (goal, beg) goal entries filled from local content, beg names the source (its displaced location if moved)
+     m_dl      one goal entry per checksum absent locally - the download slot order
+     m_dl_goal goal entries filled from download slot s, at [m_dl_off[s], m_dl_off[s + 1])
+   local paths absent from the goal are left alone
+   copy sources are never copy destinations (kept and goal-less files are not written, moved ones are displaced first)
+   so copies may run in any order, and concurrently with downloads */
+class PsDiff
+{
+public:
+	using idx_t = uint32_t;
+
+	/* paths compare bytewise (as _fnames_rec_sorted and the binary listfile order them) -
+	   inputs already in that order are merged in one linear pass, others are sorted by index first */
+	inline static bool
+	_path_less(const boost::filesystem::path &a, const boost::filesystem::path &b)
+	{
+		return a.native() < b.native();
+	}
+
+	template<typename K>
+	inline static std::vector<idx_t>
+	_order(size_t n, K key)
+	{
+		if (n >= PsShaTable::s_none)
+			throw std::runtime_error("");
+		std::vector<idx_t> ord(n);
+		std::iota(ord.begin(), ord.end(), 0);
+		if (!std::is_sorted(ord.begin(), ord.end(), [&](idx_t a, idx_t b) { return key(a) < key(b); }))
+			std::sort(ord.begin(), ord.end(), [&](idx_t a, idx_t b) { return key(a) < key(b); });
+		return ord;
+	}
+
+	inline static PsDiff
+	mk(
+		const std::vector<boost::filesystem::path> &beg_fils,
+		const std::vector<ps_sha_t> &beg_sums,
+		const std::vector<boost::filesystem::path> &goal_fils,
+		const std::vector<ps_sha_t> &goal_sums)
+	{
+		if (beg_fils.size() != beg_sums.size() || goal_fils.size() != goal_sums.size())
+			throw std::out_of_range("");
+		return _mk(
+			[&](idx_t b) -> const auto & { return beg_fils[b].native(); }, beg_sums,
+			[&](idx_t g) -> const auto & { return goal_fils[g].native(); }, goal_sums);
+	}
+
+	/* over paths interned in a PsStrPool (the two sides may use different pools) */
+	inline static PsDiff
+	mk(
+		const PsStrPool &beg_pool,
+		const std::vector<PsStrPool::id_t> &beg_ids,
+		const std::vector<ps_sha_t> &beg_sums,
+		const PsStrPool &goal_pool,
+		const std::vector<PsStrPool::id_t> &goal_ids,
+		const std::vector<ps_sha_t> &goal_sums)
+	{
+		if (beg_ids.size() != beg_sums.size() || goal_ids.size() != goal_sums.size())
+			throw std::out_of_range("");
+		return _mk(
+			[&](idx_t b) { return beg_pool.str(beg_ids[b]); }, beg_sums,
+			[&](idx_t g) { return goal_pool.str(goal_ids[g]); }, goal_sums);
+	}
+
+	/* bkey(b), gkey(g) - the path of an entry, compared bytewise */
+	template<typename BK, typename GK>
+	inline static PsDiff
+	_mk(
+		BK bkey,
+		const std::vector<ps_sha_t> &beg_sums,
+		GK gkey,
+		const std::vector<ps_sha_t> &goal_sums)
+	{
+		const std::vector<idx_t> bo = _order(beg_sums.size(), bkey);
+		const std::vector<idx_t> go = _order(goal_sums.size(), gkey);
+
+		PsShaTable have(beg_sums.size());
+		for (idx_t b = 0; b < beg_sums.size(); b++)
+			have.insert(beg_sums[b], b);
+
+		PsDiff d;
+		// goal entries needing content, in path order
+		std::vector<idx_t> need;
+		need.reserve(go.size());
+		for (size_t i = 0, j = 0; j < go.size(); j++) {
+			const idx_t g = go[j];
+			if (j && !(gkey(go[j - 1]) < gkey(g)))
+				throw std::runtime_error("");
+			while (i < bo.size() && bkey(bo[i]) < gkey(g))
+				i++;
+			if (i < bo.size() && bkey(bo[i]) == gkey(g)) {
+				if (beg_sums[bo[i]] == goal_sums[g]) {
+					d.m_keep.push_back(g);
+					continue;
+				}
+				d.m_move.push_back(std::make_pair(bo[i], g));
+			}
+			need.push_back(g);
+		}
+
+		PsShaTable slots(need.size());
+		std::vector<idx_t> slot(need.size(), PsShaTable::s_none);
+		for (size_t j = 0; j < need.size(); j++) {
+			const idx_t g = need[j];
+			if (const idx_t b = have.find(goal_sums[g]); b != PsShaTable::s_none) {
+				d.m_copy.push_back(std::make_pair(g, b));
+				continue;
+			}
+			if ((slot[j] = slots.insert(goal_sums[g], (idx_t) d.m_dl.size())) == d.m_dl.size())
+				d.m_dl.push_back(g);
+		}
+
+		d.m_dl_off.assign(d.m_dl.size() + 1, 0);
+		for (const idx_t s : slot)
+			if (s != PsShaTable::s_none)
+				d.m_dl_off[s + 1]++;
+		std::partial_sum(d.m_dl_off.begin(), d.m_dl_off.end(), d.m_dl_off.begin());
+		d.m_dl_goal.resize(d.m_dl_off.back());
+		std::vector<idx_t> fill(d.m_dl_off.begin(), d.m_dl_off.end() - 1);
+		for (size_t j = 0; j < need.size(); j++)
+			if (slot[j] != PsShaTable::s_none)
+				d.m_dl_goal[fill[slot[j]]++] = need[j];
+
+		return d;
+	}
+
+	std::vector<idx_t> m_keep;
+	std::vector<std::pair<idx_t, idx_t> > m_move;
+	std::vector<std::pair<idx_t, idx_t> > m_copy;
+	std::vector<idx_t> m_dl;
+	std::vector<idx_t> m_dl_goal;
+	std::vector<idx_t> m_dl_off;
+};
+
+#endif /* _PSDIFF_HPP_ */
@@ -0,0 +1,224 @@
+#ifndef _PSFS_HPP_
+#define _PSFS_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <cerrno>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+class PsStat
+{
+public:
+	inline bool
+	operator==(const PsStat &other) const
+	{
+		return m_size == other.m_size && m_mtime_ns == other.m_mtime_ns && m_ctime_ns == other.m_ctime_ns && m_ino == other.m_ino;
+	}
+
+	inline bool operator!=(const PsStat &other) const { return !(*this == other); }
+
+	uint64_t m_size = 0;
+	int64_t m_mtime_ns = 0;
+	int64_t m_ctime_ns = 0;
+	uint64_t m_ino = 0;
+	/* the path is a symlink, the fields above are of its target (set by the walk, not compared) */
+	bool m_link = false;
+};
+
+#ifndef _WIN32
+inline PsStat
+_stat_conv(const struct stat &st)
+{
+	PsStat r;
+	r.m_size = st.st_size;
+#ifdef __linux__
+	r.m_mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	r.m_ctime_ns = int64_t(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+#else
+	r.m_mtime_ns = int64_t(st.st_mtime) * 1000000000;
+	r.m_ctime_ns = int64_t(st.st_ctime) * 1000000000;
+#endif
+	r.m_ino = st.st_ino;
+	return r;
+}
+#endif
+
+inline PsStat
+_fname_stat(const boost::filesystem::path &path)
+{
+	PsStat r;
+#ifndef _WIN32
+	struct stat st = {};
+	if (::stat(path.c_str(), &st) != 0)
+		throw std::runtime_error("");
+	r = _stat_conv(st);
+#else
+	r.m_size = boost::filesystem::file_size(path);
+	r.m_mtime_ns = int64_t(boost::filesystem::last_write_time(path)) * 1000000000;
+#endif
+	return r;
+}
+
+inline void
+_fsync_path(const boost::filesystem::path &path)
+{
+#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("");
+	const int r = ::fsync(fd);
+	::close(fd);
+	if (r != 0)
+		throw std::runtime_error("");
+#endif
+}
+
+/* makes the data and directory entries written so far to paths (files or directories, all on one filesystem) durable
+   Linux: a single syncfs of the filesystem holding them, elsewhere an fsync of each */
+inline void
+_sync_paths(const std::vector<boost::filesystem::path> &paths)
+{
+#ifdef __linux__
+	if (paths.empty())
+		return;
+	const int fd = ::open(paths.front().c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("");
+	const int r = ::syncfs(fd);
+	::close(fd);
+	if (r != 0)
+		throw std::runtime_error("");
+#else
+	for (const auto &p : paths)
+		_fsync_path(p);
+#endif
+}
+
+/* write to a temporary sibling, flush it to disk then rename over dst
+   a crash leaves either the old or the new content at dst, never a partial file */
+inline void
+_write_file_atomic(const std::string &data, const boost::filesystem::path &dst)
+{
+	const auto tmpp = dst.parent_path() / (dst.filename().string() + boost::filesystem::unique_path(".%%%%-%%%%.tmp").string());
+	{
+		boost::filesystem::ofstream ofst = boost::filesystem::ofstream(tmpp, std::ios_base::out | std::ios_base::binary);
+		if (!ofst.write(data.data(), data.size()) || !ofst.flush())
+			throw std::runtime_error("");
+	}
+	try {
+		_fsync_path(tmpp);
+		boost::filesystem::rename(tmpp, dst);
+	}
+	catch (...) {
+		boost::system::error_code ec;
+		boost::filesystem::remove(tmpp, ec);
+		throw;
+	}
+	_fsync_path(dst.parent_path());
+}
+
+/* how _materialize produced a file, cheapest first */
+enum class ps_mat_t { Hardlink, Clone, CopyRange, Copy };
+
+/* creates dst (which must not exist) with the content and permissions of src
+     Hardlink:  with hardlink set, dst becomes another name of src - only for content never written in place
+     Clone:     FICLONE reflink, shares extents copy-on-write (btrfs, XFS) - no data is written
+     CopyRange: copy_file_range, the kernel copies (or shares, on NFS 4.2 / CIFS server side copy) without a user buffer
+     Copy:      buffered read / write
+   each step falls through to the next where the filesystem refuses it, a copy_file_range that stops short hands the
+   rest to the buffered copy - dst must end up the size src had when opened, else it is removed and this throws */
+inline ps_mat_t
+_materialize(const boost::filesystem::path &src, const boost::filesystem::path &dst, bool hardlink = false)
+{
+#ifdef __linux__
+	if (hardlink && ::link(src.c_str(), dst.c_str()) == 0)
+		return ps_mat_t::Hardlink;
+	const int sfd = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st = {};
+	if (sfd < 0 || ::fstat(sfd, &st) != 0) {
+		if (sfd >= 0)
+			::close(sfd);
+		throw std::runtime_error("");
+	}
+	const int dfd = ::open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+	if (dfd < 0) {
+		::close(sfd);
+		throw std::runtime_error("");
+	}
+	ps_mat_t how = ps_mat_t::Clone;
+	bool ok = ::fchmod(dfd, st.st_mode & 07777) == 0;
+	if (ok && ::ioctl(dfd, FICLONE, sfd) != 0) {
+		how = ps_mat_t::CopyRange;
+		for (uint64_t left = st.st_size; ok && left;) {
+			const ssize_t n = ::copy_file_range(sfd, nullptr, dfd, nullptr, left, 0);
+			if (n < 0 && left == (uint64_t) st.st_size && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				how = ps_mat_t::Copy;
+				break;
+			}
+			if (n == 0) {
+				how = ps_mat_t::Copy;
+				break;
+			}
+			ok = n > 0;
+			left -= ok ? n : 0;
+		}
+		if (how == ps_mat_t::Copy) {
+			std::unique_ptr<char[]> buf(new char[1024 * 1024]);
+			for (ssize_t n; ok && (n = ::read(sfd, buf.get(), 1024 * 1024)) != 0;) {
+				ok = n > 0;
+				for (ssize_t off = 0; ok && off < n;) {
+					const ssize_t m = ::write(dfd, buf.get() + off, n - off);
+					ok = m > 0;
+					off += ok ? m : 0;
+				}
+			}
+		}
+	}
+	struct stat dst_st = {};
+	ok = ok && ::fstat(dfd, &dst_st) == 0 && dst_st.st_size == st.st_size;
+	ok = ::close(dfd) == 0 && ok;
+	::close(sfd);
+	if (!ok) {
+		::unlink(dst.c_str());
+		throw std::runtime_error("");
+	}
+	return how;
+#else
+	if (hardlink) {
+		boost::system::error_code ec;
+		boost::filesystem::create_hard_link(src, dst, ec);
+		if (!ec)
+			return ps_mat_t::Hardlink;
+	}
+	boost::filesystem::copy_file(src, dst, boost::filesystem::copy_options::none);
+	return ps_mat_t::Copy;
+#endif
+}
+
+/* per-install state (caches, journals) lives in a sibling directory "<ourroot>.psnupd",
+   keeping it out of the tree being scanned and listed */
+inline boost::filesystem::path
+_statedir(const boost::filesystem::path &ourroot)
+{
+	auto p = boost::filesystem::absolute(ourroot).lexically_normal();
+	if (p.filename() == "." || p.filename().empty())
+		p = p.parent_path();
+	return p.parent_path() / (p.filename().string() + ".psnupd");
+}
+
+#endif /* _PSFS_HPP_ */
@@ -0,0 +1,95 @@
+#ifndef _PSIO_HPP_
+#define _PSIO_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* whole-file reads of many small files, in batches - open / read / close per file, half the syscalls of the mmap
+   read path
+   each file is read as its expected size plus one byte, a file that grew meanwhile has its rest read blockingly
+   one instance per thread - the thread pool running the batches is the caller's */
+class PsBatchRead
+{
+public:
+	/* files up to this size are worth batching, larger ones stream better through _fname_checksum */
+	inline static const size_t s_small = 256 * 1024;
+
+	inline PsBatchRead(size_t depth = 64) :
+		m_depth(std::max<size_t>(depth, 1))
+	{}
+
+	PsBatchRead(const PsBatchRead &) = delete;
+	PsBatchRead &operator=(const PsBatchRead &) = delete;
+
+	/* reads the n files path(i) (expected to be size(i) bytes), calling done(i, data, len) for each in turn */
+	template<typename F, typename Z, typename D>
+	inline void
+	run(size_t n, F path, Z size, D done)
+	{
+		std::vector<std::string> paths;
+		std::vector<std::string> bufs;
+		for (size_t b = 0; b < n; b += m_depth) {
+			const size_t e = std::min(n, b + m_depth);
+			paths.clear();
+			bufs.resize(e - b);
+			for (size_t i = b; i < e; i++) {
+				paths.push_back(boost::filesystem::path(path(i)).string());
+				bufs[i - b].resize((size_t) size(i) + 1);
+			}
+			for (size_t j = 0; j < paths.size(); j++)
+				_read_one(paths[j], bufs[j]);
+			for (size_t i = b; i < e; i++)
+				done(i, (const unsigned char *) bufs[i - b].data(), bufs[i - b].size());
+		}
+	}
+
+	/* buf comes sized to the expected length plus one, leaves sized to the content */
+	inline static void
+	_read_one(const std::string &path, std::string &buf)
+	{
+#ifndef _WIN32
+		const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			throw std::runtime_error("");
+		size_t len = 0;
+		bool ok = true;
+		for (;;) {
+			if (len == buf.size())
+				buf.resize(buf.size() * 2);
+			const ssize_t r = ::read(fd, &buf[len], buf.size() - len);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				ok = r == 0;
+				break;
+			}
+			len += r;
+		}
+		::close(fd);
+		if (!ok)
+			throw std::runtime_error("");
+		buf.resize(len);
+#else
+		boost::filesystem::ifstream ifst(boost::filesystem::path(path), std::ios_base::in | std::ios_base::binary);
+		buf.assign(std::istreambuf_iterator<char>(ifst), std::istreambuf_iterator<char>());
+		if (ifst.bad())
+			throw std::runtime_error("");
+#endif
+	}
+
+	size_t m_depth;
+};
+
+#endif /* _PSIO_HPP_ */
@@ -0,0 +1,353 @@
+#ifndef _PSJOURNAL_HPP_
+#define _PSJOURNAL_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <psfs.hpp>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+/* change journal (<statedir>/journal.psjn) - '\0' terminated relative generic paths changed since the journal was last taken
+   a path covers itself and everything below it, the empty path covers the whole tree (the watcher started,
+   its queue overflowed or the root itself went away)
+   a running watcher holds an exclusive flock on <statedir>/journal.lock for its whole lifetime,
+   both sides flock the journal itself around each append / take
+   a take moves the entries to <statedir>/journal.psjn.taking, dropped by _journal_done once the scan they
+   drove is saved - a take after a failed or interrupted scan gets them again */
+inline boost::filesystem::path
+_journal_path(const boost::filesystem::path &ourroot)
+{
+	return _statedir(ourroot) / "journal.psjn";
+}
+
+inline boost::filesystem::path
+_journal_taking_path(const boost::filesystem::path &ourroot)
+{
+	return _statedir(ourroot) / "journal.psjn.taking";
+}
+
+inline boost::filesystem::path
+_journal_lock_path(const boost::filesystem::path &ourroot)
+{
+	return _statedir(ourroot) / "journal.lock";
+}
+
+#ifdef __linux__
+
+inline void
+_journal_append(const boost::filesystem::path &ourroot, const std::vector<std::string> &recs)
+{
+	std::string buf;
+	for (const auto &r : recs)
+		buf.append(r.c_str(), r.size() + 1);
+	const int fd = ::open(_journal_path(ourroot).c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("");
+	bool ok = ::flock(fd, LOCK_EX) == 0;
+	for (size_t off = 0; ok && off < buf.size();) {
+		const ssize_t n = ::write(fd, buf.data() + off, buf.size() - off);
+		ok = n > 0;
+		off += ok ? n : 0;
+	}
+	::close(fd);
+	if (!ok)
+		throw std::runtime_error("");
+}
+
+/* empties the journal into dirty (sorted, with paths covered by another entry dropped), together with the entries
+   of takes not yet followed by _journal_done
+   false when it can not be trusted - no watcher is running, or it recorded a whole-tree change */
+inline bool
+_journal_take(const boost::filesystem::path &ourroot, std::vector<std::string> &dirty)
+{
+	dirty.clear();
+	if (!boost::filesystem::is_directory(_statedir(ourroot)))
+		return false;
+	const int lfd = ::open(_journal_lock_path(ourroot).c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (lfd < 0)
+		throw std::runtime_error("");
+	const bool watched = ::flock(lfd, LOCK_SH | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+	::close(lfd);
+
+	const int fd = ::open(_journal_path(ourroot).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("");
+	const auto slurp = [](int fd, std::string &buf) {
+		buf.clear();
+		for (char tmp[64 * 1024];;) {
+			const ssize_t n = ::read(fd, tmp, sizeof tmp);
+			if (n <= 0)
+				return n == 0;
+			buf.append(tmp, n);
+		}
+	};
+	std::string buf;
+	bool ok = ::flock(fd, LOCK_EX) == 0 && slurp(fd, buf);
+	// on disk aside before the journal lets go of them
+	const int tfd = ok ? ::open(_journal_taking_path(ourroot).c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644) : -1;
+	ok = ok && tfd >= 0;
+	for (size_t off = 0; ok && off < buf.size();) {
+		const ssize_t n = ::write(tfd, buf.data() + off, buf.size() - off);
+		ok = n > 0;
+		off += ok ? n : 0;
+	}
+	ok = ok && ::fsync(tfd) == 0;
+	ok = ok && ::ftruncate(fd, 0) == 0;
+	ok = ok && ::lseek(tfd, 0, SEEK_SET) == 0 && slurp(tfd, buf);
+	if (tfd >= 0)
+		::close(tfd);
+	::close(fd);
+	if (!ok)
+		throw std::runtime_error("");
+
+	bool all = !watched;
+	for (size_t off = 0, end; off < buf.size(); off = end + 1) {
+		if ((end = buf.find('\0', off)) == std::string::npos)
+			break;
+		if (end == off)
+			all = true;
+		dirty.push_back(buf.substr(off, end - off));
+	}
+	if (all) {
+		dirty.clear();
+		return false;
+	}
+	// a/b sorts right after a and before a0 only with '/' lowest - compare as if it were
+	std::sort(dirty.begin(), dirty.end(), [](const std::string &a, const std::string &b) {
+		return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+			return (x == '/' ? 0 : (unsigned char) x) < (y == '/' ? 0 : (unsigned char) y);
+		});
+	});
+	std::vector<std::string> kept;
+	for (auto &d : dirty)
+		if (kept.empty() || !(d == kept.back() || (d.size() > kept.back().size() && d.compare(0, kept.back().size(), kept.back()) == 0 && d[kept.back().size()] == '/')))
+			kept.push_back(std::move(d));
+	dirty = std::move(kept);
+	return true;
+}
+
+/* the entries taken so far are covered by a saved scan */
+inline void
+_journal_done(const boost::filesystem::path &ourroot)
+{
+	boost::system::error_code ec;
+	boost::filesystem::remove(_journal_taking_path(ourroot), ec);
+}
+
+/* inotify watcher - journals every path created, written, deleted or moved under ourroot until destroyed
+   directories are watched recursively (new ones as they appear), symlinks are not followed
+   only one watcher per tree, constructing a second one throws */
+class PsWatch
+{
+public:
+	inline static const uint32_t s_mask =
+		IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+		IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+	inline PsWatch(const boost::filesystem::path &ourroot) :
+		m_root(ourroot),
+		m_lockfd(-1),
+		m_fd(-1),
+		m_stopfd(-1),
+		m_mtx(),
+		m_wd(),
+		m_busy(false),
+		m_thread()
+	{
+		try {
+			boost::filesystem::create_directories(_statedir(m_root));
+			if ((m_lockfd = ::open(_journal_lock_path(m_root).c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644)) < 0 || ::flock(m_lockfd, LOCK_EX | LOCK_NB) != 0)
+				throw std::runtime_error("");
+			if ((m_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 || (m_stopfd = ::eventfd(0, EFD_CLOEXEC)) < 0)
+				throw std::runtime_error("");
+			std::vector<std::string> recs;
+			_add(std::string(), recs);
+			// whatever happened before the watches were in place is unknown
+			_journal_append(m_root, { std::string() });
+			m_thread = std::thread(&PsWatch::_run, this);
+		}
+		catch (...) {
+			_close();
+			throw;
+		}
+	}
+
+	inline ~PsWatch()
+	{
+		const uint64_t one = 1;
+		if (::write(m_stopfd, &one, sizeof one) != sizeof one)
+			std::terminate();
+		m_thread.join();
+		_close();
+	}
+
+	PsWatch(const PsWatch &) = delete;
+	PsWatch &operator=(const PsWatch &) = delete;
+
+	/* returns once every event queued so far is in the journal */
+	inline void
+	sync()
+	{
+		for (;;) {
+			{
+				std::lock_guard<std::mutex> l(m_mtx);
+				int pending = 0;
+				if (::ioctl(m_fd, FIONREAD, &pending) != 0)
+					throw std::runtime_error("");
+				if (!pending && !m_busy)
+					return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+
+	inline void
+	_close()
+	{
+		for (int *fd : { &m_fd, &m_stopfd, &m_lockfd })
+			if (*fd >= 0)
+				::close(*fd), *fd = -1;
+	}
+
+	/* watches rel and every directory below it, a directory appearing in between is caught by its parent's watch */
+	inline void
+	_add(const std::string &rel, std::vector<std::string> &recs)
+	{
+		const int wd = ::inotify_add_watch(m_fd, (m_root / rel).c_str(), s_mask);
+		if (wd < 0) {
+			// vanished (or is not a directory) meanwhile - its parent reports that, anything else loses events
+			if (errno != ENOENT && errno != ENOTDIR)
+				recs.push_back(std::string());
+			return;
+		}
+		m_wd[wd] = rel;
+		boost::system::error_code ec;
+		for (auto it = boost::filesystem::directory_iterator(m_root / rel, ec); !ec && it != boost::filesystem::directory_iterator(); it.increment(ec))
+			if (it->symlink_status(ec).type() == boost::filesystem::directory_file)
+				_add((rel.empty() ? std::string() : rel + "/") + it->path().filename().string(), recs);
+	}
+
+	/* drops the watches on rel and below - a moved directory keeps its watch descriptors, named by the old path */
+	inline void
+	_del(const std::string &rel)
+	{
+		for (auto it = m_wd.begin(); it != m_wd.end();) {
+			const std::string &r = it->second;
+			if (r == rel || (r.size() > rel.size() && r.compare(0, rel.size(), rel) == 0 && r[rel.size()] == '/')) {
+				::inotify_rm_watch(m_fd, it->first);
+				it = m_wd.erase(it);
+			}
+			else
+				++it;
+		}
+	}
+
+	inline void
+	_run()
+	{
+		alignas(struct inotify_event) char buf[64 * 1024];
+		for (;;) {
+			struct pollfd pfd[2] = { { m_fd, POLLIN, 0 }, { m_stopfd, POLLIN, 0 } };
+			if (::poll(pfd, 2, -1) < 0 && errno != EINTR)
+				break;
+			if (pfd[1].revents)
+				break;
+			{
+				std::lock_guard<std::mutex> l(m_mtx);
+				m_busy = true;
+			}
+			std::vector<std::string> recs;
+			for (ssize_t n; (n = ::read(m_fd, buf, sizeof buf)) > 0;)
+				for (ssize_t off = 0; off < n;) {
+					const struct inotify_event *ev = (const struct inotify_event *) (buf + off);
+					off += sizeof *ev + ev->len;
+					_event(ev, recs);
+				}
+			try {
+				if (recs.size())
+					_journal_append(m_root, recs);
+			}
+			catch (std::exception &) {
+				// the next take sees a stale journal - make sure it at least is not trusted
+				::flock(m_lockfd, LOCK_UN);
+			}
+			std::lock_guard<std::mutex> l(m_mtx);
+			m_busy = false;
+		}
+	}
+
+	inline void
+	_event(const struct inotify_event *ev, std::vector<std::string> &recs)
+	{
+		if (ev->mask & IN_Q_OVERFLOW) {
+			recs.push_back(std::string());
+			return;
+		}
+		const auto it = m_wd.find(ev->wd);
+		if (it == m_wd.end())
+			return;
+		const std::string rel = it->second;
+		if (ev->mask & IN_IGNORED) {
+			m_wd.erase(it);
+			return;
+		}
+		if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+			recs.push_back(rel);
+			return;
+		}
+		const std::string path = ev->len ? (rel.empty() ? std::string() : rel + "/") + ev->name : rel;
+		if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_MOVED_FROM | IN_DELETE)))
+			_del(path);
+		if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+			_add(path, recs);
+		recs.push_back(path);
+	}
+
+	boost::filesystem::path m_root;
+	int m_lockfd;
+	int m_fd;
+	int m_stopfd;
+	std::mutex m_mtx;
+	std::unordered_map<int, std::string> m_wd;
+	bool m_busy;
+	std::thread m_thread;
+};
+
+#else /* __linux__ */
+
+inline bool
+_journal_take(const boost::filesystem::path &ourroot, std::vector<std::string> &dirty)
+{
+	dirty.clear();
+	return false;
+}
+
+inline void
+_journal_done(const boost::filesystem::path &ourroot)
+{
+}
+
+#endif /* __linux__ */
+
+#endif /* _PSJOURNAL_HPP_ */
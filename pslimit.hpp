@@ -0,0 +1,150 @@
+#ifndef _PSLIMIT_HPP_
+#define _PSLIMIT_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+/* bandwidth class of a request - a waiting class is served before every lower one */
+enum class ps_prio_t { Bulk, Normal, Critical, NPrio };
+
+/* time as seen by PsBucket - replaced by a fake one in tests */
+class PsClock
+{
+public:
+	inline virtual ~PsClock() {}
+
+	inline virtual int64_t
+	now_ns()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/* waits on cv (holding l) until now_ns() reaches ns or cv is notified */
+	inline virtual void
+	wait_until(std::unique_lock<std::mutex> &l, std::condition_variable &cv, int64_t ns)
+	{
+		cv.wait_for(l, std::chrono::nanoseconds(ns - now_ns()));
+	}
+
+	inline static PsClock &
+	steady()
+	{
+		static PsClock clock;
+		return clock;
+	}
+};
+
+/* token bucket of m_rate bytes per second holding up to m_burst bytes (starting full)
+   take(n) waits for min(n, m_burst) tokens then takes n - a request larger than the bucket leaves it in debt,
+   paid off by whoever takes next, so the average rate holds for any request size
+   takers of a class wait while one of a higher class does */
+class PsBucket
+{
+public:
+	inline PsBucket(uint64_t rate, uint64_t burst = 0, PsClock &clock = PsClock::steady()) :
+		m_rate(rate),
+		m_burst(burst ? burst : rate),
+		m_clock(clock),
+		m_tokens((double) m_burst),
+		m_last_ns(clock.now_ns())
+	{
+		if (!m_rate)
+			throw std::runtime_error("");
+	}
+
+	inline void
+	take(uint64_t n, ps_prio_t prio = ps_prio_t::Normal)
+	{
+		if (!n)
+			return;
+		std::unique_lock<std::mutex> l(m_mtx);
+		m_nwait[(size_t) prio]++;
+		for (;;) {
+			const int64_t now = m_clock.now_ns();
+			m_tokens = std::min<double>(m_burst, m_tokens + (double) (now - m_last_ns) * m_rate / 1e9);
+			m_last_ns = now;
+			if (std::any_of(m_nwait + (size_t) prio + 1, m_nwait + (size_t) ps_prio_t::NPrio, [](size_t w) { return w; })) {
+				m_cv.wait(l);
+				continue;
+			}
+			const double want = (double) std::min(n, m_burst);
+			if (m_tokens >= want)
+				break;
+			m_clock.wait_until(l, m_cv, now + (int64_t) std::ceil((want - m_tokens) * 1e9 / m_rate));
+		}
+		m_nwait[(size_t) prio]--;
+		m_tokens -= (double) n;
+		m_cv.notify_all();
+	}
+
+	uint64_t m_rate;
+	uint64_t m_burst;
+	PsClock &m_clock;
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	double m_tokens;
+	int64_t m_last_ns;
+	size_t m_nwait[(size_t) ps_prio_t::NPrio] = {};
+};
+
+/* throttle of one connection - its own bucket (m_rate bytes per second, 0 - unlimited) then m_global, shared by
+   every connection of the update (nullptr - unlimited) */
+class PsLimit
+{
+public:
+	inline PsLimit(std::shared_ptr<PsBucket> global, uint64_t rate = 0, uint64_t burst = 0, PsClock &clock = PsClock::steady()) :
+		m_global(std::move(global)),
+		m_own(rate ? std::make_unique<PsBucket>(rate, burst, clock) : nullptr)
+	{}
+
+	inline void
+	take(uint64_t n, ps_prio_t prio)
+	{
+		if (m_own)
+			m_own->take(n, prio);
+		if (m_global)
+			m_global->take(n, prio);
+	}
+
+	/* the throttle of a cloned connection - a fresh bucket of its own, the same global one */
+	inline std::shared_ptr<PsLimit>
+	fork() const
+	{
+		if (!m_own)
+			return std::make_shared<PsLimit>(m_global);
+		return std::make_shared<PsLimit>(m_global, m_own->m_rate, m_own->m_burst, m_own->m_clock);
+	}
+
+	std::shared_ptr<PsBucket> m_global;
+	std::unique_ptr<PsBucket> m_own;
+};
+
+/* sets prio for the lifetime of the object, restoring the previous class after */
+class PsPrio
+{
+public:
+	inline PsPrio(std::atomic<ps_prio_t> &prio, ps_prio_t p) :
+		m_prio(prio),
+		m_old(prio.exchange(p))
+	{}
+
+	inline ~PsPrio()
+	{
+		m_prio = m_old;
+	}
+
+	PsPrio(const PsPrio &) = delete;
+	PsPrio &operator=(const PsPrio &) = delete;
+
+	std::atomic<ps_prio_t> &m_prio;
+	ps_prio_t m_old;
+};
+
+#endif /* _PSLIMIT_HPP_ */
@@ -0,0 +1,204 @@
+#ifndef _PSLIST_HPP_
+#define _PSLIST_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* binary listfile (listfile.psbl), all integers little-endian
+     header  "PSBL" u32:version u64:count u64:strtab_off u64:strtab_len
+     entry   count * { u64:path_off u32:path_len u32:reserved u64:size u8[32]:sha }   sorted bytewise by path
+     strtab  path bytes, path_off is relative to strtab_off
+   every field is naturally aligned, a mapped file is used in place - lookups are a binary search over the entries */
+class PsBinList
+{
+public:
+	inline static const char s_magic[4] = { 'P', 'S', 'B', 'L' };
+	inline static const uint32_t s_version = 1;
+	inline static const size_t s_hdrlen = 32;
+	inline static const size_t s_entlen = 56;
+
+	inline PsBinList(const char *data, size_t len) :
+		m_data(data),
+		m_len(len),
+		m_count(0),
+		m_strtab(nullptr),
+		m_strtab_len(0)
+	{
+		if (len < s_hdrlen || memcmp(data, s_magic, sizeof s_magic) != 0 || _u32(data + 4) != s_version)
+			throw std::runtime_error("");
+		m_count = _u64(data + 8);
+		const uint64_t strtab_off = _u64(data + 16);
+		m_strtab_len = _u64(data + 24);
+		if (m_count > (len - s_hdrlen) / s_entlen || strtab_off < s_hdrlen + m_count * s_entlen || strtab_off > len || m_strtab_len > len - strtab_off)
+			throw std::runtime_error("");
+		m_strtab = data + strtab_off;
+		for (size_t i = 0; i < m_count; i++) {
+			const char *e = _ent(i);
+			if (_u64(e) > m_strtab_len || _u32(e + 8) > m_strtab_len - _u64(e))
+				throw std::runtime_error("");
+			if (i && !(path(i - 1) < path(i)))
+				throw std::runtime_error("");
+		}
+	}
+
+	inline size_t size() const { return m_count; }
+	inline std::string_view path(size_t i) const { const char *e = _ent(i); return std::string_view(m_strtab + _u64(e), _u32(e + 8)); }
+	inline uint64_t fsize(size_t i) const { return _u64(_ent(i) + 16); }
+	inline const unsigned char *sha(size_t i) const { return (const unsigned char *) _ent(i) + 24; }
+
+	/* index of path, or size() when absent */
+	inline size_t
+	find(std::string_view p) const
+	{
+		size_t lo = 0, hi = m_count;
+		while (lo < hi) {
+			const size_t mid = lo + (hi - lo) / 2;
+			if (path(mid) < p)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo < m_count && path(lo) == p ? lo : m_count;
+	}
+
+	inline const char *_ent(size_t i) const { return m_data + s_hdrlen + i * s_entlen; }
+
+	inline static uint32_t
+	_u32(const char *p)
+	{
+		const unsigned char *u = (const unsigned char *) p;
+		return uint32_t(u[0]) | uint32_t(u[1]) << 8 | uint32_t(u[2]) << 16 | uint32_t(u[3]) << 24;
+	}
+
+	inline static uint64_t
+	_u64(const char *p)
+	{
+		return uint64_t(_u32(p)) | uint64_t(_u32(p + 4)) << 32;
+	}
+
+	inline static void
+	_put_u32(std::string &buf, uint32_t v)
+	{
+		for (size_t i = 0; i < 4; i++)
+			buf.push_back((char) (v >> (8 * i)));
+	}
+
+	inline static void
+	_put_u64(std::string &buf, uint64_t v)
+	{
+		_put_u32(buf, (uint32_t) v);
+		_put_u32(buf, (uint32_t) (v >> 32));
+	}
+
+	/* (path, size, 32 raw sha bytes) - any order, duplicate paths are rejected */
+	inline static std::string
+	encode(std::vector<std::tuple<std::string, uint64_t, std::string> > ents)
+	{
+		std::sort(ents.begin(), ents.end());
+		std::string buf(s_magic, sizeof s_magic), strtab;
+		_put_u32(buf, s_version);
+		_put_u64(buf, ents.size());
+		_put_u64(buf, s_hdrlen + ents.size() * s_entlen);
+		size_t strtab_len = 0;
+		for (const auto &[p, siz, sha] : ents)
+			strtab_len += p.size();
+		_put_u64(buf, strtab_len);
+		for (size_t i = 0; i < ents.size(); i++) {
+			const auto &[p, siz, sha] = ents[i];
+			if (sha.size() != 32 || p.size() > UINT32_MAX || (i && p == std::get<0>(ents[i - 1])))
+				throw std::runtime_error("");
+			_put_u64(buf, strtab.size());
+			_put_u32(buf, (uint32_t) p.size());
+			_put_u32(buf, 0);
+			_put_u64(buf, siz);
+			buf.append(sha);
+			strtab.append(p);
+		}
+		return buf + strtab;
+	}
+
+	const char *m_data;
+	size_t m_len;
+	uint64_t m_count;
+	const char *m_strtab;
+	uint64_t m_strtab_len;
+};
+
+/* a PsBinList over a local file - mapped on linux, read into memory elsewhere */
+class PsBinListFile
+{
+public:
+	inline PsBinListFile(const boost::filesystem::path &file) :
+		m_buf(),
+		m_map(nullptr),
+		m_maplen(0),
+		m_list()
+	{
+#ifdef __linux__
+		int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st = {};
+		if (fd < 0 || ::fstat(fd, &st) != 0) {
+			if (fd >= 0)
+				::close(fd);
+			throw std::runtime_error("");
+		}
+		m_maplen = st.st_size;
+		m_map = m_maplen ? ::mmap(nullptr, m_maplen, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+		::close(fd);
+		if (m_map == MAP_FAILED) {
+			m_map = nullptr;
+			throw std::runtime_error("");
+		}
+		try {
+			m_list = std::make_unique<PsBinList>((const char *) m_map, m_maplen);
+		}
+		catch (...) {
+			if (m_map)
+				::munmap(m_map, m_maplen);
+			throw;
+		}
+#else
+		m_buf.resize(boost::filesystem::file_size(file));
+		boost::filesystem::ifstream ifst = boost::filesystem::ifstream(file, std::ios_base::in | std::ios_base::binary);
+		if (!ifst.read(&m_buf[0], m_buf.size()))
+			throw std::runtime_error("");
+		m_list = std::make_unique<PsBinList>(m_buf.data(), m_buf.size());
+#endif
+	}
+
+	inline ~PsBinListFile()
+	{
+#ifdef __linux__
+		if (m_map)
+			::munmap(m_map, m_maplen);
+#endif
+	}
+
+	PsBinListFile(const PsBinListFile &) = delete;
+	PsBinListFile &operator=(const PsBinListFile &) = delete;
+
+	inline const PsBinList &list() const { return *m_list; }
+
+	std::string m_buf;
+	void *m_map;
+	size_t m_maplen;
+	std::unique_ptr<PsBinList> m_list;
+};
+
+#endif /* _PSLIST_HPP_ */
@@ -0,0 +1,552 @@
+#ifndef _PSMIRROR_HPP_
+#define _PSMIRROR_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+#include <pscon.hpp>
+#include <psnupd.hpp>
+#include <pspool.hpp>
+#include <psstore.hpp>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* caching mirror - serves a published tree over HTTP, pulling what it does not have from an upstream PsCon
+   (PsConNet to the origin or to another mirror, PsConFs for a local copy), so a site fetches each file once
+     files named by the upstream listfile.psli are cached by checksum in m_store (a PsStore, size bounded,
+     shareable with the installs of the host), verified on the way in
+     anything else (the listfiles themselves, chunk manifests, pre-compressed siblings) is cached under
+     <cachedir>/meta for m_ttl seconds, then fetched again - served stale while the upstream is unreachable
+   requests are GET / HEAD with optional single Range and If-Range (ETag is the checksum, or size-mtime for meta),
+   served asynchronously on nthread threads, bodies go out with sendfile
+   a miss is pulled through on one of nthread pull threads (m_pull), its session resumes on the io_context once the
+   content landed - hits are answered without ever waiting for a pull, concurrent misses of one path wait for a
+   single pull */
+class PsMirror
+{
+public:
+	inline static const char s_list[] = "listfile.psli";
+
+	/* the content a request is answered from */
+	class Ent
+	{
+	public:
+		uint64_t m_size = 0;
+		std::string m_etag;
+#ifdef __linux__
+		int m_fd = -1;
+#else
+		std::unique_ptr<boost::filesystem::ifstream> m_ifst;
+#endif
+	};
+
+	/* one client connection - only touched from the handler currently running for it */
+	class Session
+	{
+	public:
+		inline Session(tcp::socket &&sock) :
+			m_sock(std::move(sock))
+		{}
+
+		inline ~Session()
+		{
+			_close();
+		}
+
+		inline void
+		_close()
+		{
+#ifdef __linux__
+			if (m_ent.m_fd >= 0)
+				::close(m_ent.m_fd), m_ent.m_fd = -1;
+#else
+			m_ent.m_ifst.reset();
+#endif
+			m_ent.m_etag.clear();
+		}
+
+		tcp::socket m_sock;
+		boost::beast::flat_buffer m_buf;
+		std::optional<http::request_parser<http::empty_body> > m_parser;
+		http::response<http::empty_body> m_res;
+		Ent m_ent;
+		uint64_t m_off = 0;
+		uint64_t m_end = 0;
+		bool m_keep = false;
+#ifndef __linux__
+		std::unique_ptr<char[]> m_chunk;
+#endif
+	};
+
+	/* listens on port ("0" - any free one, see m_port), caching under cachedir, at most max bytes of objects (0 - unbounded) */
+	inline PsMirror(PsCon &upstream, const boost::filesystem::path &cachedir, const std::string &port, uint64_t max = 0, size_t nthread = 4) :
+		m_upstream(upstream),
+		m_cachedir(cachedir),
+		m_store(cachedir / "objects", max),
+		m_ttl(60),
+		m_mtx(),
+		m_cv(),
+		m_pulling(),
+		m_index(),
+		m_idle(),
+		m_bytes(0),
+		m_ioc(),
+		m_acceptor(m_ioc, tcp::endpoint(tcp::v4(), (unsigned short) std::stoi(port))),
+		m_port(std::to_string(m_acceptor.local_endpoint().port())),
+		m_t(),
+		m_pull(std::max<size_t>(nthread, 1))
+	{
+		boost::filesystem::remove_all(m_cachedir / "tmp");
+		boost::filesystem::create_directories(m_cachedir / "tmp");
+		boost::filesystem::create_directories(m_cachedir / "meta");
+		m_bytes = m_store.trim();
+		try {
+			_index_load();
+		}
+		catch (std::exception &) {
+		}
+		_accept();
+		for (size_t i = 0; i < std::max<size_t>(nthread, 1); i++)
+			m_t.emplace_back([this]() { m_ioc.run(); });
+	}
+
+	inline ~PsMirror()
+	{
+		m_ioc.stop();
+		for (auto &t : m_t)
+			t.join();
+	}
+
+	PsMirror(const PsMirror &) = delete;
+	PsMirror &operator=(const PsMirror &) = delete;
+
+	/* rel as a path under the published tree - throws for anything escaping it */
+	inline static std::string
+	_target_rel(boost::beast::string_view target)
+	{
+		if (target.size() < 2 || target[0] != '/')
+			throw std::runtime_error("");
+		const std::string rel(target.substr(1));
+		for (const auto &c : boost::filesystem::path(rel))
+			if (c == ".." || c == "." || c.empty() || c == "/")
+				throw std::runtime_error("");
+		if (rel.find('\0') != std::string::npos || rel.find('\\') != std::string::npos)
+			throw std::runtime_error("");
+		return rel;
+	}
+
+	/* "bytes=b-" or "bytes=b-e" of a size byte body into [b, e) - 0 no usable range (the whole body is served),
+	   1 a range, -1 unsatisfiable */
+	inline static int
+	_range(const std::string &v, uint64_t size, uint64_t &b, uint64_t &e)
+	{
+		boost::smatch what;
+		if (!boost::regex_match(v, what, boost::regex("bytes=([0-9]{1,19})-([0-9]{0,19})")))
+			return 0;
+		b = std::stoull(what[1]);
+		e = what[2].length() ? std::stoull(what[2]) + 1 : size;
+		if (e <= b)
+			return 0;
+		if (b >= size)
+			return -1;
+		e = std::min(e, size);
+		return 1;
+	}
+
+	/* pulls key unless stale() says the cached copy is good - concurrent calls for one key wait for a single pull */
+	template<typename S, typename P>
+	inline void
+	_single(const std::string &key, S stale, P pull)
+	{
+		std::unique_lock<std::mutex> l(m_mtx);
+		m_cv.wait(l, [&]() { return !m_pulling.count(key); });
+		if (!stale())
+			return;
+		m_pulling.insert(key);
+		l.unlock();
+		try {
+			pull();
+		}
+		catch (...) {
+			l.lock();
+			m_pulling.erase(key);
+			m_cv.notify_all();
+			throw;
+		}
+		l.lock();
+		m_pulling.erase(key);
+		m_cv.notify_all();
+	}
+
+	/* runs fn on an idle upstream connection - one that threw is dropped */
+	template<typename F>
+	inline void
+	_with_con(F fn)
+	{
+		std::unique_ptr<PsCon> con;
+		{
+			std::lock_guard<std::mutex> l(m_mtx);
+			if (m_idle.size()) {
+				con = std::move(m_idle.back());
+				m_idle.pop_back();
+			}
+		}
+		if (!con && !(con = m_upstream.clone()))
+			throw std::runtime_error("");
+		fn(*con);
+		std::lock_guard<std::mutex> l(m_mtx);
+		m_idle.push_back(std::move(con));
+	}
+
+	inline void
+	_index_load()
+	{
+		PsStrPool pool;
+		const auto [ids, sums] = _tmp_listfile_text(_readfile(m_cachedir / "meta" / s_list), pool);
+		std::unordered_map<std::string, ps_sha_t> index;
+		for (size_t i = 0; i < ids.size(); i++)
+			index[std::string(pool.str(ids[i]))] = sums[i];
+		std::lock_guard<std::mutex> l(m_mtx);
+		m_index = std::move(index);
+	}
+
+	/* meta file p is missing or older than m_ttl */
+	inline bool
+	_stale(const boost::filesystem::path &p)
+	{
+		boost::system::error_code ec;
+		const std::time_t t = boost::filesystem::last_write_time(p, ec);
+		return ec || std::time(nullptr) - t >= (std::time_t) m_ttl;
+	}
+
+	/* <cachedir>/meta/rel, fetched again once older than m_ttl - the stale copy if that fails */
+	inline boost::filesystem::path
+	_meta(const std::string &rel)
+	{
+		const boost::filesystem::path p = m_cachedir / "meta" / rel;
+		const auto stale = [&]() { return _stale(p); };
+		try {
+			_single("m" + rel, stale, [&]() {
+				const boost::filesystem::path tmp = m_cachedir / "tmp" / boost::filesystem::unique_path();
+				try {
+					_with_con([&](PsCon &con) { con.req_file(rel, "", tmp); });
+					boost::filesystem::create_directories(p.parent_path());
+					boost::filesystem::rename(tmp, p);
+				}
+				catch (...) {
+					boost::system::error_code ec;
+					boost::filesystem::remove(tmp, ec);
+					throw;
+				}
+				if (rel == s_list)
+					_index_load();
+			});
+		}
+		catch (std::exception &) {
+			if (!boost::filesystem::is_regular_file(p))
+				throw;
+		}
+		return p;
+	}
+
+	/* pulls rel (listed with checksum sha) into m_store, trimming it when over budget - true with ent opened on the
+	   pulled content (before the trim could evict it), false if another request pulled it meanwhile */
+	inline bool
+	_pull_obj(const std::string &rel, const ps_sha_t &sha, Ent &ent)
+	{
+		bool pulled = false;
+		_single("o" + sha.hex(), [&]() { return !boost::filesystem::is_regular_file(m_store._obj(sha)); }, [&]() {
+			const boost::filesystem::path tmp = m_cachedir / "tmp" / boost::filesystem::unique_path();
+			try {
+				_with_con([&](PsCon &con) {
+					if (con.req_file(rel, "", tmp) != sha)
+						throw std::runtime_error("");
+				});
+				m_store.put(sha, tmp, true);
+				ent.m_etag = "\"" + sha.hex() + "\"";
+				if (!(pulled = _open(tmp, ent)))
+					throw std::runtime_error("");
+			}
+			catch (...) {
+				boost::system::error_code ec;
+				boost::filesystem::remove(tmp, ec);
+				throw;
+			}
+			const uint64_t size = boost::filesystem::file_size(tmp);
+			boost::filesystem::remove(tmp);
+			std::lock_guard<std::mutex> l(m_mtx);
+			if ((m_bytes += size) > m_store.m_max && m_store.m_max)
+				m_bytes = m_store.trim();
+		});
+		return pulled;
+	}
+
+	/* false when p can not be opened (an object evicted meanwhile) */
+	inline static bool
+	_open(const boost::filesystem::path &p, Ent &ent)
+	{
+#ifdef __linux__
+		struct stat st = {};
+		if ((ent.m_fd = ::open(p.c_str(), O_RDONLY | O_CLOEXEC)) < 0)
+			return false;
+		if (::fstat(ent.m_fd, &st) != 0)
+			throw std::runtime_error("");
+		ent.m_size = st.st_size;
+		if (ent.m_etag.empty())
+			ent.m_etag = "\"" + std::to_string(st.st_size) + "-" + std::to_string(st.st_mtime) + "\"";
+#else
+		ent.m_ifst = std::make_unique<boost::filesystem::ifstream>(p, std::ios_base::in | std::ios_base::binary);
+		if (!ent.m_ifst->is_open())
+			return false;
+		ent.m_size = boost::filesystem::file_size(p);
+		if (ent.m_etag.empty())
+			ent.m_etag = "\"" + std::to_string(ent.m_size) + "-" + std::to_string(boost::filesystem::last_write_time(p)) + "\"";
+#endif
+		return true;
+	}
+
+	inline bool
+	_open_obj(const ps_sha_t &sha, Ent &ent)
+	{
+		PsStore::Lock l(m_store.m_dir, false);
+		ent.m_etag = "\"" + sha.hex() + "\"";
+		return _open(m_store._obj(sha), ent);
+	}
+
+	/* opens what rel is answered with if the cache has it fresh, without touching the upstream - false otherwise */
+	inline bool
+	_resolve_cached(const std::string &rel, Ent &ent)
+	{
+		if (_stale(m_cachedir / "meta" / s_list))
+			return false;
+		std::optional<ps_sha_t> sha;
+		{
+			std::lock_guard<std::mutex> l(m_mtx);
+			if (const auto it = m_index.find(rel); it != m_index.end())
+				sha = it->second;
+		}
+		if (sha)
+			return _open_obj(*sha, ent);
+		return !_stale(m_cachedir / "meta" / rel) && _open(m_cachedir / "meta" / rel, ent);
+	}
+
+	/* opens what rel is answered with - throws when the upstream does not have it */
+	inline void
+	_resolve(const std::string &rel, Ent &ent)
+	{
+		if (rel != s_list)
+			_meta(s_list);
+		std::optional<ps_sha_t> sha;
+		{
+			std::lock_guard<std::mutex> l(m_mtx);
+			if (const auto it = m_index.find(rel); it != m_index.end())
+				sha = it->second;
+		}
+		if (!sha) {
+			if (!_open(_meta(rel), ent))
+				throw std::runtime_error("");
+			return;
+		}
+		// an object can be evicted between its pull and another request opening it
+		for (size_t i = 0; i < 3; i++)
+			if (_open_obj(*sha, ent) || _pull_obj(rel, *sha, ent))
+				return;
+		throw std::runtime_error("");
+	}
+
+	inline void
+	_accept()
+	{
+		m_acceptor.async_accept([this](const boost::system::error_code &ec, tcp::socket sock) {
+			if (!ec) {
+				auto s = std::make_shared<Session>(std::move(sock));
+				boost::system::error_code ec_;
+				s->m_sock.set_option(tcp::no_delay(true), ec_);
+				_read(s);
+			}
+			if (m_acceptor.is_open())
+				_accept();
+		});
+	}
+
+	inline void
+	_read(const std::shared_ptr<Session> &s)
+	{
+		s->_close();
+		s->m_parser.emplace();
+		http::async_read(s->m_sock, s->m_buf, *s->m_parser, [this, s](const boost::system::error_code &ec, size_t) {
+			if (!ec)
+				_serve(s);
+		});
+	}
+
+	/* answers a hit right away, a miss once m_pull resolved it */
+	inline void
+	_serve(const std::shared_ptr<Session> &s)
+	{
+		const auto &req = s->m_parser->get();
+		if (req.method() != http::verb::get && req.method() != http::verb::head)
+			return _respond(s, false);
+		std::string rel;
+		try {
+			rel = _target_rel(req.target());
+			if (_resolve_cached(rel, s->m_ent))
+				return _respond(s, true);
+		}
+		catch (std::exception &) {
+			return _respond(s, false);
+		}
+		s->_close();
+		m_pull.post([this, s, rel]() {
+			bool ok = true;
+			try {
+				_resolve(rel, s->m_ent);
+			}
+			catch (std::exception &) {
+				ok = false;
+			}
+			boost::asio::post(m_ioc, [this, s, ok]() { _respond(s, ok); });
+		});
+	}
+
+	/* the response head for m_ent (opened if ok, a 404 otherwise), then the body */
+	inline void
+	_respond(const std::shared_ptr<Session> &s, bool ok)
+	{
+		const auto &req = s->m_parser->get();
+		auto &res = s->m_res;
+		res = http::response<http::empty_body>(http::status::ok, 11);
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		s->m_keep = req.keep_alive();
+		res.keep_alive(s->m_keep);
+		res.content_length(0);
+		s->m_off = s->m_end = 0;
+		if (req.method() != http::verb::get && req.method() != http::verb::head)
+			res.result(http::status::method_not_allowed);
+		else {
+			try {
+				if (!ok)
+					throw std::runtime_error("");
+				uint64_t b = 0, e = s->m_ent.m_size;
+				int r = req.count(http::field::range) ? _range(req[http::field::range].to_string(), s->m_ent.m_size, b, e) : 0;
+				if (req.count(http::field::if_range) && req[http::field::if_range] != s->m_ent.m_etag)
+					r = 0, b = 0, e = s->m_ent.m_size;
+				res.set(http::field::etag, s->m_ent.m_etag);
+				res.set(http::field::accept_ranges, "bytes");
+				if (r < 0) {
+					res.result(http::status::range_not_satisfiable);
+					res.set(http::field::content_range, "bytes */" + std::to_string(s->m_ent.m_size));
+				}
+				else {
+					if (r > 0) {
+						res.result(http::status::partial_content);
+						res.set(http::field::content_range, "bytes " + std::to_string(b) + "-" + std::to_string(e - 1) + "/" + std::to_string(s->m_ent.m_size));
+					}
+					res.content_length(e - b);
+					if (req.method() == http::verb::get)
+						s->m_off = b, s->m_end = e;
+				}
+			}
+			catch (std::exception &) {
+				res = http::response<http::empty_body>(http::status::not_found, 11);
+				res.keep_alive(s->m_keep);
+				res.content_length(0);
+			}
+		}
+		http::async_write(s->m_sock, res, [this, s](const boost::system::error_code &ec, size_t) {
+			if (!ec)
+				_send(s);
+		});
+	}
+
+	/* body bytes [m_off, m_end) of m_ent, then the next request on a kept alive connection */
+	inline void
+	_send(const std::shared_ptr<Session> &s)
+	{
+#ifdef __linux__
+		if (s->m_off < s->m_end && !s->m_sock.native_non_blocking())
+			s->m_sock.native_non_blocking(true);
+		while (s->m_off < s->m_end) {
+			off_t off = (off_t) s->m_off;
+			const ssize_t n = ::sendfile(s->m_sock.native_handle(), s->m_ent.m_fd, &off, (size_t) std::min<uint64_t>(s->m_end - s->m_off, 1 << 30));
+			if (n > 0) {
+				s->m_off = off;
+				continue;
+			}
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && errno == EAGAIN) {
+				s->m_sock.async_wait(tcp::socket::wait_write, [this, s](const boost::system::error_code &ec) {
+					if (!ec)
+						_send(s);
+				});
+				return;
+			}
+			// the file shrank or the peer went away - dropping the session closes the connection
+			return;
+		}
+#else
+		if (s->m_off < s->m_end) {
+			if (!s->m_chunk)
+				s->m_chunk.reset(new char[64 * 1024]);
+			const size_t n = (size_t) std::min<uint64_t>(s->m_end - s->m_off, 64 * 1024);
+			if (!s->m_ent.m_ifst->seekg(s->m_off) || !s->m_ent.m_ifst->read(s->m_chunk.get(), n))
+				return;
+			s->m_off += n;
+			boost::asio::async_write(s->m_sock, boost::asio::buffer(s->m_chunk.get(), n), [this, s](const boost::system::error_code &ec, size_t) {
+				if (!ec)
+					_send(s);
+			});
+			return;
+		}
+#endif
+		if (s->m_keep)
+			return _read(s);
+		boost::system::error_code ec;
+		s->m_sock.shutdown(tcp::socket::shutdown_send, ec);
+	}
+
+	PsCon &m_upstream;
+	boost::filesystem::path m_cachedir;
+	PsStore m_store;
+	/* seconds a meta file is served before it is fetched again */
+	uint64_t m_ttl;
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::set<std::string> m_pulling;
+	std::unordered_map<std::string, ps_sha_t> m_index;
+	std::vector<std::unique_ptr<PsCon> > m_idle;
+	uint64_t m_bytes;
+	boost::asio::io_context m_ioc;
+	tcp::acceptor m_acceptor;
+	std::string m_port;
+	std::vector<std::thread> m_t;
+	/* last - stopped first, while everything its pulls touch is alive */
+	PsPool m_pull;
+};
+
+#endif /* _PSMIRROR_HPP_ */
@@ -0,0 +1,410 @@
+#ifndef _PSMULTI_HPP_
+#define _PSMULTI_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+#include <pscon.hpp>
+
+/* one PsCon over several mirrors of the same tree (PsConNet, PsConFs, ...)
+     every request goes to the source expected to answer it fastest - latency and throughput are learned online as
+     EWMAs (shared between clones), sources not tried yet are tried first
+     a request running past m_hedge times its expected duration (m_hedge_cold_ms while nothing is known) is
+     hedged on the next best source, the first answer wins
+     a failed request fails over down the ranking, the source is then considered down for m_down_ms, doubling with
+     each further failure - down sources are still used once nothing else is left
+   each attempt runs on its own thread, a losing one is left to finish in the background and its source skipped
+   meanwhile (waited for once every source is busy) - the destructor waits for those
+   req_file_resume: every attempt downloads into a file of its own, the winner's is renamed onto dst - only the
+   first attempt (and failovers after it) continue dst and report checkpoints, linking their file as dst to do so,
+   a hedge starts over
+   throttles (m_limit) go on the sources, each attempt runs in the class (m_prio) of the request */
+class PsConMulti : public PsCon
+{
+public:
+	/* requests of at least this many bytes measure throughput, smaller ones latency */
+	inline static const uint64_t s_big = 64 * 1024;
+	/* size assumed for requests of unknown size */
+	inline static const uint64_t s_typical = 1024 * 1024;
+
+	/* what is known of one source */
+	class Stat
+	{
+	public:
+		double m_lat = 0;
+		double m_bps = 0;
+		size_t m_nlat = 0;
+		size_t m_nbps = 0;
+		size_t m_fail = 0;
+		std::chrono::steady_clock::time_point m_down;
+	};
+
+	class Stats
+	{
+	public:
+		std::mutex m_mtx;
+		std::vector<Stat> m_s;
+	};
+
+	class Src
+	{
+	public:
+		std::unique_ptr<PsCon> m_con;
+		/* an attempt is running on m_con */
+		std::shared_ptr<std::atomic<bool> > m_run;
+	};
+
+	/* thrown by an attempt finding the request already answered - counts neither for nor against its source */
+	class Cancel : public std::runtime_error
+	{
+	public:
+		inline Cancel() : std::runtime_error("") {}
+	};
+
+	/* one request raced across sources - m_won is the slot of the first attempt that succeeded */
+	class Race
+	{
+	public:
+		std::mutex m_mtx;
+		std::condition_variable m_cv;
+		size_t m_running = 0;
+		int m_won = -1;
+		std::exception_ptr m_err;
+	};
+
+	using run_t = std::function<uint64_t(PsCon &con, size_t slot, bool hedge)>;
+
+	inline PsConMulti(std::vector<std::unique_ptr<PsCon> > srcs) :
+		PsCon(),
+		m_src(),
+		m_stats(std::make_shared<Stats>())
+	{
+		if (srcs.empty())
+			throw std::runtime_error("");
+		for (auto &c : srcs)
+			m_src.push_back(Src{ std::move(c), std::make_shared<std::atomic<bool> >(false) });
+		m_stats->m_s.resize(m_src.size());
+	}
+
+	inline virtual ~PsConMulti() override
+	{
+		for (auto &t : m_task)
+			t.wait();
+	}
+
+	/* clones every source, the clone shares what is known of them - nullptr if a source can not be cloned */
+	inline virtual std::unique_ptr<PsCon>
+	clone() override
+	{
+		std::vector<std::unique_ptr<PsCon> > srcs;
+		for (auto &s : m_src) {
+			srcs.push_back(s.m_con->clone());
+			if (!srcs.back())
+				return nullptr;
+		}
+		auto c = std::make_unique<PsConMulti>(std::move(srcs));
+		c->m_stats = m_stats;
+		c->m_zsib = m_zsib;
+		c->m_ckpt = m_ckpt;
+		c->m_prio = m_prio.load();
+		c->m_hedge = m_hedge;
+		c->m_hedge_min_ms = m_hedge_min_ms;
+		c->m_hedge_cold_ms = m_hedge_cold_ms;
+		c->m_down_ms = m_down_ms;
+		return c;
+	}
+
+	/* seconds source i is expected to take for n bytes, negative while nothing is known of it */
+	inline double
+	_expect(size_t i, uint64_t n)
+	{
+		const Stat &s = m_stats->m_s[i];
+		if (!s.m_nlat && !s.m_nbps)
+			return -1;
+		return s.m_lat + (s.m_nbps ? (double) (n ? n : s_typical) / s.m_bps : 0);
+	}
+
+	inline void
+	_record(size_t i, uint64_t n, double secs, bool ok)
+	{
+		const double a = 0.3;
+		std::lock_guard<std::mutex> l(m_stats->m_mtx);
+		Stat &s = m_stats->m_s[i];
+		if (!ok) {
+			s.m_down = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::min<uint64_t>(m_down_ms << std::min<size_t>(s.m_fail, 16), 60000));
+			s.m_fail++;
+			return;
+		}
+		s.m_fail = 0;
+		if (n < s_big) {
+			s.m_lat = s.m_nlat++ ? a * secs + (1 - a) * s.m_lat : secs;
+			return;
+		}
+		const double bps = (double) n / std::max(secs - s.m_lat, 1e-6);
+		s.m_bps = s.m_nbps++ ? a * bps + (1 - a) * s.m_bps : bps;
+	}
+
+	/* idle sources best first for a request of n bytes - healthy ones, then down ones */
+	inline std::vector<size_t>
+	_rank(uint64_t n)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		std::vector<double> score(m_src.size());
+		std::vector<size_t> order;
+		{
+			std::lock_guard<std::mutex> l(m_stats->m_mtx);
+			for (size_t i = 0; i < m_src.size(); i++) {
+				score[i] = std::max(_expect(i, n), 0.0) + (m_stats->m_s[i].m_down > now ? 1e9 : 0);
+				if (!*m_src[i].m_run)
+					order.push_back(i);
+			}
+		}
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return score[a] < score[b]; });
+		return order;
+	}
+
+	/* forgets finished attempts - with block, waits for one still running first */
+	inline void
+	_reap(bool block)
+	{
+		if (block)
+			for (auto &t : m_task)
+				if (t.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+					t.wait();
+					break;
+				}
+		m_task.erase(std::remove_if(m_task.begin(), m_task.end(), [](std::future<void> &t) {
+			return t.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		}), m_task.end());
+	}
+
+	/* starts run on idle source i as attempt slot - race->m_mtx is held by the caller */
+	inline void
+	_launch(size_t i, size_t slot, bool hedge, const std::shared_ptr<Race> &race, const run_t &run)
+	{
+		race->m_running++;
+		PsCon *con = m_src[i].m_con.get();
+		std::shared_ptr<std::atomic<bool> > busy = m_src[i].m_run;
+		*busy = true;
+		con->m_prio = m_prio.load();
+		m_task.push_back(std::async(std::launch::async, [this, i, slot, hedge, race, run, con, busy]() {
+			const auto t0 = std::chrono::steady_clock::now();
+			uint64_t n = 0;
+			bool cancel = false;
+			std::exception_ptr e;
+			try {
+				n = run(*con, slot, hedge);
+			}
+			catch (Cancel &) {
+				cancel = true;
+				e = std::current_exception();
+			}
+			catch (...) {
+				e = std::current_exception();
+			}
+			if (!cancel)
+				_record(i, n, std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count(), !e);
+			std::lock_guard<std::mutex> l(race->m_mtx);
+			*busy = false;
+			race->m_running--;
+			if (!e && race->m_won < 0)
+				race->m_won = (int) slot;
+			if (e && !race->m_err)
+				race->m_err = e;
+			race->m_cv.notify_all();
+		}));
+	}
+
+	/* runs a request of n bytes (0 - unknown) as attempts run(con, slot, hedge) down the ranking, returns the slot
+	   of the attempt whose result counts - throws the first error once every source failed */
+	inline size_t
+	_route(uint64_t n, const run_t &run)
+	{
+		_reap(false);
+		std::vector<size_t> order;
+		while ((order = _rank(n)).empty())
+			_reap(true);
+		auto race = std::make_shared<Race>();
+		size_t next = 0;
+		auto hedge_at = std::chrono::steady_clock::time_point::max();
+		std::unique_lock<std::mutex> l(race->m_mtx);
+		while (race->m_won < 0) {
+			if (!race->m_running) {
+				if (next == order.size())
+					std::rethrow_exception(race->m_err);
+				const size_t i = order[next];
+				double expect;
+				{
+					std::lock_guard<std::mutex> ls(m_stats->m_mtx);
+					expect = _expect(i, n);
+				}
+				_launch(i, next, false, race, run);
+				next++;
+				const uint64_t ms = expect < 0 ? m_hedge_cold_ms : std::max<uint64_t>(m_hedge_min_ms, (uint64_t) (expect * m_hedge * 1000));
+				hedge_at = m_hedge > 0 && next < order.size() ? std::chrono::steady_clock::now() + std::chrono::milliseconds(ms) : std::chrono::steady_clock::time_point::max();
+				continue;
+			}
+			if (hedge_at == std::chrono::steady_clock::time_point::max())
+				race->m_cv.wait(l);
+			else if (race->m_cv.wait_until(l, hedge_at) == std::cv_status::timeout && race->m_won < 0 && race->m_running) {
+				_launch(order[next], next, true, race, run);
+				next++;
+				hedge_at = std::chrono::steady_clock::time_point::max();
+			}
+		}
+		return race->m_won;
+	}
+
+	inline virtual res_t
+	req(const std::string &path, const std::string &data) override
+	{
+		m_prog.onRequest(path, data);
+		auto res = std::make_shared<std::vector<res_t> >(m_src.size());
+		const size_t w = _route(0, [res, path, data](PsCon &con, size_t slot, bool) {
+			(*res)[slot] = con.req(path, data);
+			return (uint64_t) (*res)[slot].body().size();
+		});
+		return std::move((*res)[w]);
+	}
+
+	inline virtual res_t
+	req_range(const std::string &path, const std::string &data, uint64_t off, uint64_t len) override
+	{
+		m_prog.onRequest(path, data);
+		auto res = std::make_shared<std::vector<res_t> >(m_src.size());
+		const size_t w = _route(len, [res, path, data, off, len](PsCon &con, size_t slot, bool) {
+			(*res)[slot] = con.req_range(path, data, off, len);
+			return (uint64_t) (*res)[slot].body().size();
+		});
+		return std::move((*res)[w]);
+	}
+
+	inline virtual ps_sha_t
+	req_file(const std::string &path, const std::string &data, const boost::filesystem::path &dst) override
+	{
+		PsSha256 sha;
+		std::string validator;
+		req_file_resume(path, data, dst, sha, validator, nullptr);
+		return sha.finish();
+	}
+
+	/* the state of the attempts of one req_file_resume - the caller's sha, validator and ckpt, and dst, are only
+	   touched under m_mtx and not after m_done, when the caller adopts the winner */
+	class FileRace
+	{
+	public:
+		std::mutex m_mtx;
+		bool m_done = false;
+		std::vector<PsSha256> m_sha;
+		std::vector<std::string> m_validator;
+		std::vector<boost::filesystem::path> m_file;
+	};
+
+	inline virtual void
+	req_file_resume(const std::string &path, const std::string &data, const boost::filesystem::path &dst, PsSha256 &sha, std::string &validator, const std::function<void()> &ckpt) override
+	{
+		m_prog.onRequest(path, data);
+		auto st = std::make_shared<FileRace>();
+		st->m_sha.resize(m_src.size());
+		st->m_validator.resize(m_src.size());
+		st->m_file.resize(m_src.size());
+		PsSha256 *sha_ = &sha;
+		std::string *validator_ = &validator;
+		const std::function<void()> *ckpt_ = &ckpt;
+		const size_t w = _route(0, [st, path, data, dst, sha_, validator_, ckpt_](PsCon &con, size_t slot, bool hedge) {
+			PsSha256 s;
+			std::string v;
+			const boost::filesystem::path f = dst.string() + ".m" + std::to_string(slot);
+			{
+				std::lock_guard<std::mutex> l(st->m_mtx);
+				if (st->m_done)
+					throw Cancel();
+				boost::filesystem::remove(f);
+				if (!hedge && sha_->m_len) {
+					// continuing from the last checkpoint - whatever a failed attempt wrote after it goes
+					s = *sha_;
+					v = *validator_;
+					boost::filesystem::create_hard_link(dst, f);
+					boost::filesystem::resize_file(f, s.m_len);
+				}
+				st->m_file[slot] = f;
+			}
+			const uint64_t off = s.m_len;
+			try {
+				con.req_file_resume(path, data, f, s, v, [&]() {
+					std::lock_guard<std::mutex> l(st->m_mtx);
+					if (st->m_done)
+						throw Cancel();
+					if (!hedge && *ckpt_) {
+						if (!boost::filesystem::exists(dst) || !boost::filesystem::equivalent(f, dst)) {
+							boost::system::error_code ec;
+							boost::filesystem::remove(dst, ec);
+							boost::filesystem::create_hard_link(f, dst);
+						}
+						*sha_ = s;
+						*validator_ = v;
+						(*ckpt_)();
+					}
+				});
+			}
+			catch (...) {
+				// dst keeps what was checkpointed
+				boost::system::error_code ec;
+				boost::filesystem::remove(f, ec);
+				throw;
+			}
+			std::lock_guard<std::mutex> l(st->m_mtx);
+			if (st->m_done) {
+				// lost - the winner was adopted meanwhile
+				boost::system::error_code ec;
+				boost::filesystem::remove(f, ec);
+				throw Cancel();
+			}
+			st->m_sha[slot] = s;
+			st->m_validator[slot] = v;
+			return s.m_len - off;
+		});
+		std::lock_guard<std::mutex> l(st->m_mtx);
+		st->m_done = true;
+		sha = st->m_sha[w];
+		validator = st->m_validator[w];
+		for (size_t i = 0; i < st->m_file.size(); i++) {
+			if (st->m_file[i].empty())
+				continue;
+			// a no-op when the file is linked as dst already
+			if (i == w)
+				boost::filesystem::rename(st->m_file[i], dst);
+			boost::system::error_code ec;
+			boost::filesystem::remove(st->m_file[i], ec);
+		}
+	}
+
+	std::vector<Src> m_src;
+	std::shared_ptr<Stats> m_stats;
+	/* attempts not known to have finished */
+	std::vector<std::future<void> > m_task;
+	/* hedge once an attempt runs this many times its expected duration (0 - never), but not before m_hedge_min_ms,
+	   and after m_hedge_cold_ms while nothing is known of the source */
+	double m_hedge = 3;
+	uint64_t m_hedge_min_ms = 20;
+	uint64_t m_hedge_cold_ms = 1000;
+	/* a failed source is skipped for this long, doubling with each consecutive failure (up to a minute) */
+	uint64_t m_down_ms = 1000;
+};
+
+#endif /* _PSMULTI_HPP_ */
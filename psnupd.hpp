@@ -1,17 +1,44 @@
+#ifndef _PSNUPD_HPP_
+#define _PSNUPD_HPP_
+
 #include <cassert>
+#include <cctype>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
 #include <istream>
 #include <map>
-#include <set>
+#include <memory>
 #include <sstream>
+#include <string_view>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <hasher.hpp>
+#include <psapply.hpp>
+#include <psarena.hpp>
+#include <pscache.hpp>
+#include <pscdc.hpp>
 #include <pscon.hpp>
+#include <psdiff.hpp>
+#include <psfs.hpp>
+#include <psio.hpp>
+#include <psjournal.hpp>
+#include <pslimit.hpp>
+#include <pslist.hpp>
+#include <pspart.hpp>
+#include <pspool.hpp>
+#include <psstore.hpp>
+#include <pswalk.hpp>
+#include <pszip.hpp>
 
 #include <boost/algorithm/string/regex.hpp>
 #include <boost/filesystem.hpp>
@@ -19,7 +46,80 @@
 
 // boost::filesystem::{weakly_}canonical : weakly does not require existence
 
-using ps_sha_t = std::string;
+/* per stage progress of _main_pipe - items completed, plus start and end of each stage in ns since the update began
+   (overlapping [m_beg_ns, m_end_ns) intervals show the stages running concurrently) */
+class NupdStat
+{
+public:
+	enum stage_t { Listfile, Scan, Download, Apply, NStage };
+
+	inline void
+	beg(stage_t s)
+	{
+		m_beg_ns[s] = _now_ns() - m_t0_ns;
+	}
+
+	inline void
+	end(stage_t s)
+	{
+		m_end_ns[s] = _now_ns() - m_t0_ns;
+	}
+
+	int64_t m_t0_ns = _now_ns();
+	std::atomic<uint64_t> m_n[NStage] = {};
+	std::atomic<int64_t> m_beg_ns[NStage] = {};
+	std::atomic<int64_t> m_end_ns[NStage] = {};
+};
+
+class NupdOpt
+{
+public:
+	/* checksumming threads - 1 hashes on the calling thread, 0 sizes the pool to the machine */
+	size_t m_nthread = 1;
+	/* consult and rewrite the hash cache at _hashcache_path - only files whose stat changed get rehashed */
+	bool m_cache = false;
+	/* with m_cache: ignore cached checksums, rehash everything and rewrite the cache */
+	bool m_verify = false;
+	/* with m_cache: take the change journal of a running PsWatch and revisit only the paths in it, everything else
+	   keeps its cached entry without being looked at (a full scan when the journal can not be trusted) */
+	bool m_journal = false;
+	/* how the hasher reads file contents */
+	ps_read_t m_read = ps_read_t::Auto;
+	/* read small files whole in batches (see PsBatchRead), m_read then only applies to the larger ones */
+	bool m_batch = false;
+	/* fetch the chunk manifest listfile.pscl and assemble missing files from local chunks plus ranged requests */
+	bool m_cdc = false;
+	/* downloads kept in flight, each over its own connection (see PsCon::clone) */
+	size_t m_ndl = 1;
+	/* fetch the binary listfile.psbl (see PsBinList) instead of listfile.psli, falling back to the latter if missing */
+	bool m_listbin = false;
+	/* run _main as the staged pipeline of _main_pipe */
+	bool m_pipe = false;
+	/* _main_pipe: capacity of the queue between the download and apply stages */
+	size_t m_pipe_depth = 64;
+	/* _main_pipe: receives per stage progress */
+	NupdStat *m_stat = nullptr;
+	/* goal files with equal content share one inode (see _materialize) - only for trees of read-only assets,
+	   a file written in place would change every path linked to it */
+	bool m_hardlink = false;
+	/* shared object store - consulted before downloading, every download is added to it and it is trimmed after
+	   the update (objects are copied in and out, never linked - see PsStore) */
+	PsStore *m_store = nullptr;
+	/* class of the download of a goal path (see _prio_exec) - downloads are started highest class first, and the
+	   classes share the connections' throttles (PsCon::m_limit) in that order, nullptr - every download Normal
+	   the listfile and chunk manifest are always fetched Critical */
+	std::function<ps_prio_t(std::string_view path)> m_prio;
+};
+
+/* executables and libraries Critical, everything else Bulk - extensions in any case (.EXE, .Dll) */
+inline ps_prio_t
+_prio_exec(std::string_view path)
+{
+	for (const std::string_view ext : { ".exe", ".dll", ".so", ".dylib", ".sh", ".bat" })
+		if (path.size() >= ext.size() && std::equal(ext.begin(), ext.end(), path.end() - ext.size(), [](char a, char b) { return a == std::tolower((unsigned char) b); }))
+			return ps_prio_t::Critical;
+	return ps_prio_t::Bulk;
+}
 
 template<typename T, typename U>
 class ItPair
@@ -64,50 +164,6 @@ public:
 	U &m_b;
 };
 
-class NupdD
-{
-public:
-	using dd_t = std::map<boost::filesystem::path, NupdD>;
-
-	inline NupdD(const ps_sha_t &a, const ps_sha_t &b) : m_a(a), m_b(b) {}
-	inline NupdD() = default;
-	inline NupdD(const NupdD &) = default;
-
-	inline static dd_t mk(
-		const std::vector<boost::filesystem::path> &beg_fils,
-		const std::vector<ps_sha_t> &beg_sums,
-		const std::vector<boost::filesystem::path> &goal_fils,
-		const std::vector<ps_sha_t> &goal_sums)
-	{
-		dd_t dd;
-		for (const auto &[k, v] : ItPair(goal_fils, goal_sums))
-			dd[k].m_a = v;
-		for (const auto &[k, v] : ItPair(beg_fils, beg_sums))
-			dd[k].m_b = v;
-		return dd;
-	}
-
-	inline static void
-	xform_AB_AN__XX_NB(NupdD &fr, NupdD &to)
-	{
-		NupdD fr_(fr.m_a, ps_sha_t());
-		NupdD to_(ps_sha_t(), fr.m_b);
-		fr = fr_;
-		to = to_;
-	}
-
-	inline static void
-	xform_AN_AA(NupdD &v)
-	{
-		v = NupdD(v.m_a, v.m_a);
-	}
-
-	ps_sha_t m_a;
-	ps_sha_t m_b;
-};
-
-using nupdd_t = std::map<boost::filesystem::path, NupdD>;
-
 inline std::vector<std::string>
 _re_getline(const std::string &str)
 {
@@ -132,11 +188,10 @@ _re_match(const std::string &str, const char *regx)
 inline std::vector<boost::filesystem::path>
 _fnames_rec_sorted(const boost::filesystem::path &dirp)
 {
+	PsStrPool pool;
 	std::vector<boost::filesystem::path> fils;
-	for (auto it = boost::filesystem::recursive_directory_iterator(dirp); it != boost::filesystem::recursive_directory_iterator(); ++it)
-		if (const boost::filesystem::path &f = it->path(); boost::filesystem::is_regular_file(f))
-			fils.push_back(f);
-	std::sort(fils.begin(), fils.end());
+	for (const auto &e : _dir_walk(dirp, pool))
+		fils.push_back(dirp / pool.path(e.m_id));
 	return fils;
 }
 
@@ -149,21 +204,261 @@ _fnames_checksum(const std::vector<boost::filesystem::path> &fils)
 	return shas;
 }
 
-inline std::tuple<std::vector<boost::filesystem::path>, std::vector<ps_sha_t> >
-_dir_checksum(const boost::filesystem::path &dirp)
+inline std::vector<boost::filesystem::path>
+_pool_paths(const PsStrPool &pool, const std::vector<PsStrPool::id_t> &ids)
 {
-	std::vector<boost::filesystem::path> fils_ = _fnames_rec_sorted(dirp);
-	std::vector<ps_sha_t> sums = _fnames_checksum(fils_);
 	std::vector<boost::filesystem::path> fils;
-	for (size_t i = 0; i < fils_.size(); i++)
-		fils.push_back(boost::filesystem::relative(fils_[i], dirp));
-	return std::make_tuple(fils, sums);
+	fils.reserve(ids.size());
+	for (const auto id : ids)
+		fils.push_back(pool.path(id));
+	return fils;
+}
+
+/* checksums of n files, file(i) naming the i-th and size(i) giving its size */
+template<typename F, typename Z>
+inline std::vector<ps_sha_t>
+_fnames_checksum_fn(size_t n, F file, Z size, const NupdOpt &opt)
+{
+	const size_t nthread = opt.m_nthread;
+	std::vector<ps_sha_t> shas(n);
+	std::vector<uintmax_t> sizes;
+	if (nthread != 1 || opt.m_batch)
+		for (size_t i = 0; i < n; i++)
+			sizes.push_back(size(i));
+	// with m_batch small files are read whole by PsBatchRead, one batch per task, and hashed from memory
+	// each thread keeps one PsBatchRead for all the batches it runs
+	std::vector<size_t> small, rest;
+	for (size_t i = 0; i < n; i++)
+		(opt.m_batch && sizes[i] <= PsBatchRead::s_small ? small : rest).push_back(i);
+	const size_t depth = 64;
+	std::vector<std::unique_ptr<PsBatchRead> > rds(1);
+	PsPool *owner = nullptr;
+	const auto batch = [&](size_t b) {
+		std::unique_ptr<PsBatchRead> &rd = rds[owner && PsPool::_self().first == owner ? PsPool::_self().second : 0];
+		if (!rd)
+			rd = std::make_unique<PsBatchRead>(depth);
+		rd->run(
+			std::min(depth, small.size() - b),
+			[&](size_t k) -> decltype(auto) { return file(small[b + k]); },
+			[&](size_t k) { return sizes[small[b + k]]; },
+			[&](size_t k, const unsigned char *data, size_t len) {
+				PsSha256 sha;
+				sha.update(data, len);
+				shas[small[b + k]] = sha.finish();
+			});
+	};
+	if (nthread == 1) {
+		for (size_t b = 0; b < small.size(); b += depth)
+			batch(b);
+		for (const size_t i : rest)
+			shas[i] = _fname_checksum(file(i), ps_sha_engine_t::Auto, opt.m_read);
+		return shas;
+	}
+	// a single file can not be split without changing its digest - instead schedule largest first
+	// so that a huge file starts hashing at once rather than becoming the tail
+	std::stable_sort(rest.begin(), rest.end(), [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+	PsPool pool(nthread);
+	rds.resize(pool.size());
+	owner = &pool;
+	for (const size_t i : rest)
+		pool.post([&shas, &file, &opt, i]() { shas[i] = _fname_checksum(file(i), ps_sha_engine_t::Auto, opt.m_read); });
+	for (size_t b = 0; b < small.size(); b += depth)
+		pool.post([&batch, b]() { batch(b); });
+	pool.wait();
+	return shas;
+}
+
+inline std::vector<ps_sha_t>
+_fnames_checksum(const std::vector<boost::filesystem::path> &fils, const NupdOpt &opt)
+{
+	return _fnames_checksum_fn(
+		fils.size(),
+		[&](size_t i) -> const boost::filesystem::path & { return fils[i]; },
+		[&](size_t i) { return boost::filesystem::file_size(fils[i]); },
+		opt);
+}
+
+/* _fnames_checksum_fn through the hash cache, rel(i) being the cache key (relative generic path) of the i-th file
+   and stat(i) its current stat */
+template<typename F, typename R, typename S>
+inline std::vector<ps_sha_t>
+_fnames_checksum_cached_fn(size_t n, F file, R rel, S stat, const boost::filesystem::path &cachefile, const NupdOpt &opt)
+{
+	const int64_t stamp_ns = _now_ns();
+	PsHashCache cache(cachefile);
+	std::vector<PsStat> stas;
+	std::vector<ps_sha_t> sums(n);
+	std::vector<size_t> todo;
+	for (size_t i = 0; i < n; i++) {
+		stas.push_back(stat(i));
+		if (opt.m_verify || !cache.lookup(rel(i), stas[i], sums[i]))
+			todo.push_back(i);
+	}
+	std::vector<ps_sha_t> todo_sums = _fnames_checksum_fn(
+		todo.size(),
+		[&](size_t j) -> decltype(auto) { return file(todo[j]); },
+		[&](size_t j) { return stas[todo[j]].m_size; },
+		opt);
+	for (size_t j = 0; j < todo.size(); j++)
+		sums[todo[j]] = todo_sums[j];
+	for (size_t i = 0; i < n; i++)
+		cache.insert(rel(i), stas[i], sums[i]);
+	cache.save(stamp_ns);
+	return sums;
+}
+
+inline std::vector<ps_sha_t>
+_fnames_checksum_cached(const std::vector<boost::filesystem::path> &fils_, const std::vector<boost::filesystem::path> &fils, const boost::filesystem::path &cachefile, const NupdOpt &opt)
+{
+	return _fnames_checksum_cached_fn(
+		fils.size(),
+		[&](size_t i) -> const boost::filesystem::path & { return fils_[i]; },
+		[&](size_t i) { return fils[i].generic_string(); },
+		[&](size_t i) { return _fname_stat(fils_[i]); },
+		cachefile,
+		opt);
+}
+
+/* the scan limited to the journalled paths - cache holds the previous scan, dirty comes from _journal_take
+   symlinked entries are always rescanned - the watch journals the link, not a change to its target */
+inline std::tuple<std::vector<PsStrPool::id_t>, std::vector<ps_sha_t> >
+_dir_checksum_journal(const boost::filesystem::path &dirp, const NupdOpt &opt, PsStrPool &pool, PsHashCache &cache, std::vector<std::string> dirty)
+{
+	const int64_t stamp_ns = _now_ns();
+	for (const auto &[k, v] : cache.m_old)
+		if (v.m_st.m_link)
+			dirty.push_back(k);
+	ps_walk_raw_t fresh;
+	for (const auto &d : dirty) {
+		const auto p = dirp / d;
+		boost::system::error_code ec;
+		const auto st = boost::filesystem::symlink_status(p, ec);
+		if (st.type() == boost::filesystem::directory_file) {
+			for (auto &[r, s] : _dir_walk_raw(p, opt.m_nthread))
+				fresh.push_back(std::make_tuple(d + "/" + r, s));
+		}
+		else if (st.type() == boost::filesystem::regular_file || (st.type() == boost::filesystem::symlink_file && boost::filesystem::is_regular_file(p, ec))) {
+			fresh.push_back(std::make_tuple(d, _fname_stat(p)));
+			std::get<1>(fresh.back()).m_link = st.type() == boost::filesystem::symlink_file;
+		}
+	}
+	std::sort(fresh.begin(), fresh.end(), [](const auto &a, const auto &b) { return std::get<0>(a) < std::get<0>(b); });
+	fresh.erase(std::unique(fresh.begin(), fresh.end(), [](const auto &a, const auto &b) { return std::get<0>(a) == std::get<0>(b); }), fresh.end());
+	std::vector<ps_sha_t> fresh_sums(fresh.size());
+	std::vector<size_t> todo;
+	for (size_t i = 0; i < fresh.size(); i++)
+		if (!cache.lookup(std::get<0>(fresh[i]), std::get<1>(fresh[i]), fresh_sums[i]))
+			todo.push_back(i);
+
+	// everything else keeps its previous entry
+	auto &old = cache.m_old;
+	for (const auto &d : dirty) {
+		old.erase(d);
+		old.erase(old.lower_bound(d + "/"), old.lower_bound(d + "0"));
+	}
+
+	std::vector<PsStrPool::id_t> ids;
+	std::vector<ps_sha_t> sums;
+	std::vector<PsStat> stas;
+	std::vector<size_t> todo_idx;
+	auto it = old.begin();
+	for (size_t i = 0; i < fresh.size() || it != old.end();) {
+		if (i < fresh.size() && (it == old.end() || std::get<0>(fresh[i]) < it->first)) {
+			if (std::binary_search(todo.begin(), todo.end(), i))
+				todo_idx.push_back(ids.size());
+			ids.push_back(pool.intern(std::get<0>(fresh[i])));
+			sums.push_back(fresh_sums[i]);
+			stas.push_back(std::get<1>(fresh[i]));
+			i++;
+		}
+		else {
+			ids.push_back(pool.intern(it->first));
+			sums.push_back(it->second.m_sha);
+			stas.push_back(it->second.m_st);
+			++it;
+		}
+	}
+
+	std::vector<ps_sha_t> todo_sums = _fnames_checksum_fn(
+		todo_idx.size(),
+		[&](size_t j) { return dirp / pool.path(ids[todo_idx[j]]); },
+		[&](size_t j) { return stas[todo_idx[j]].m_size; },
+		opt);
+	for (size_t j = 0; j < todo_idx.size(); j++)
+		sums[todo_idx[j]] = todo_sums[j];
+	for (size_t i = 0; i < ids.size(); i++)
+		cache.insert(pool.str(ids[i]), stas[i], sums[i]);
+	cache.save(stamp_ns);
+	return std::make_tuple(std::move(ids), std::move(sums));
+}
+
+/* the scan of one update session - paths relative to dirp, interned into pool
+   the walk (on m_nthread threads) already yields the stat of every file, the cache and scheduling use it as is */
+inline std::tuple<std::vector<PsStrPool::id_t>, std::vector<ps_sha_t> >
+_dir_checksum(const boost::filesystem::path &dirp, const NupdOpt &opt, PsStrPool &pool)
+{
+	if (opt.m_cache && opt.m_journal) {
+		// taken even when unused - this scan sees every change journalled so far, the entries are dropped only
+		// once it is saved (a scan failing midway leaves them to the next one)
+		std::vector<std::string> dirty;
+		std::tuple<std::vector<PsStrPool::id_t>, std::vector<ps_sha_t> > r;
+		const bool trusted = _journal_take(dirp, dirty) && !opt.m_verify;
+		if (PsHashCache cache(_hashcache_path(dirp)); trusted && cache.m_old.size())
+			r = _dir_checksum_journal(dirp, opt, pool, cache, dirty);
+		else {
+			NupdOpt opt_ = opt;
+			opt_.m_journal = false;
+			r = _dir_checksum(dirp, opt_, pool);
+		}
+		_journal_done(dirp);
+		return r;
+	}
+	const std::vector<PsWalkEnt> ents = _dir_walk(dirp, pool, opt.m_nthread);
+	std::vector<PsStrPool::id_t> ids;
+	ids.reserve(ents.size());
+	for (const auto &e : ents)
+		ids.push_back(e.m_id);
+	const auto file = [&](size_t i) { return dirp / pool.path(ids[i]); };
+	const auto size = [&](size_t i) { return ents[i].m_st.m_size; };
+	const auto rel = [&](size_t i) { return pool.str(ids[i]); };
+	const auto stat = [&](size_t i) { return ents[i].m_st; };
+	std::vector<ps_sha_t> sums = opt.m_cache ?
+		_fnames_checksum_cached_fn(ids.size(), file, rel, stat, _hashcache_path(dirp), opt) :
+		_fnames_checksum_fn(ids.size(), file, size, opt);
+	return std::make_tuple(std::move(ids), std::move(sums));
+}
+
+inline std::tuple<std::vector<boost::filesystem::path>, std::vector<ps_sha_t> >
+_dir_checksum(const boost::filesystem::path &dirp, const NupdOpt &opt = NupdOpt())
+{
+	PsStrPool pool;
+	auto [ids, sums] = _dir_checksum(dirp, opt, pool);
+	return std::make_tuple(_pool_paths(pool, ids), std::move(sums));
+}
+
+/* _dir_checksum of a tree being published - the pre-compressed siblings under _enc_sibdir are not part of it */
+inline std::tuple<std::vector<boost::filesystem::path>, std::vector<ps_sha_t> >
+_dir_checksum_published(const boost::filesystem::path &dirp, const NupdOpt &opt = NupdOpt())
+{
+	auto [fils, sums] = _dir_checksum(dirp, opt);
+	const boost::filesystem::path sibdir(_enc_sibdir());
+	size_t n = 0;
+	for (size_t i = 0; i < fils.size(); i++) {
+		if (*fils[i].begin() == sibdir)
+			continue;
+		if (n != i)
+			fils[n] = std::move(fils[i]), sums[n] = sums[i];
+		n++;
+	}
+	fils.resize(n);
+	sums.resize(n);
+	return std::make_tuple(std::move(fils), std::move(sums));
 }
 
 inline std::string
-_dir_mklistfile(const boost::filesystem::path &dirp)
+_dir_mklistfile(const boost::filesystem::path &dirp, const NupdOpt &opt = NupdOpt())
 {
-	const auto &[fils, sums] = _dir_checksum(dirp);
+	const auto &[fils, sums] = _dir_checksum_published(dirp, opt);
 	std::stringstream ss;
 	for (const auto &[k, v] : ItPair(fils, sums))
 		ss << k.string() << " " << v << std::endl;
@@ -172,32 +467,54 @@ _dir_mklistfile(const boost::filesystem::path &dirp)
 	return ss.str();
 }
 
-inline std::vector<ps_sha_t>
-_missing_checksum(const std::vector<ps_sha_t> &xold, const std::vector<ps_sha_t> &xnew)
+inline std::string
+_dir_mklistfile_bin(const boost::filesystem::path &dirp, const NupdOpt &opt = NupdOpt())
 {
-	std::set<ps_sha_t> sold;
-	for (auto &v : xold)
-		sold.insert(v);
-	std::vector<ps_sha_t> miss;
-	for (auto &v : xnew)
-		if (sold.find(v) == sold.end())
-			miss.push_back(v);
-	return miss;
+	const auto &[fils, sums] = _dir_checksum_published(dirp, opt);
+	std::vector<std::tuple<std::string, uint64_t, std::string> > ents;
+	for (const auto &[k, v] : ItPair(fils, sums))
+		ents.push_back(std::make_tuple(k.generic_string(), boost::filesystem::file_size(dirp / k), v.bin()));
+	return PsBinList::encode(std::move(ents));
 }
 
-inline std::tuple<boost::filesystem::path, boost::filesystem::path>
-_tmp_copy_tempname(const boost::filesystem::path &src, const boost::filesystem::path &dstroot)
+/* chunk manifest - one line per chunk, "FILESHA OFFSET LENGTH CHUNKSHA", for every distinct file checksum */
+inline std::string
+_dir_mkchunkfile(const boost::filesystem::path &dirp, const NupdOpt &opt = NupdOpt())
 {
-	boost::filesystem::path dstp = dstroot / boost::filesystem::unique_path();
-	boost::filesystem::copy_file(src, dstp, boost::filesystem::copy_option::fail_if_exists);
-	return std::make_tuple(dstroot, boost::filesystem::relative(dstp, dstroot));
+	const auto &[fils, sums] = _dir_checksum_published(dirp, opt);
+	std::unordered_set<ps_sha_t> done;
+	std::stringstream ss;
+	for (const auto &[k, v] : ItPair(fils, sums))
+		if (done.insert(v).second)
+			for (const auto &c : _fname_chunks(dirp / k))
+				ss << v << " " << c.m_off << " " << c.m_len << " " << c.m_sha << std::endl;
+	if (!ss.good())
+		throw std::runtime_error("");
+	return ss.str();
+}
+
+/* pre-compressed siblings for static hosting - _enc_sib of every file of dirp (listfiles included) that compresses
+   smaller, a stale sibling of one that does not is removed (see PsCon::m_zsib)
+   siblings live apart from the tree, under _enc_sibdir (rebuilt whole) - rerun after every change to the published tree */
+inline void
+_dir_mkcompressed(const boost::filesystem::path &dirp, ps_enc_t enc = _enc_best())
+{
+	boost::filesystem::remove_all(dirp / _enc_sibdir());
+	PsStrPool pool;
+	for (const auto &e : _dir_walk(dirp, pool)) {
+		const boost::filesystem::path f = dirp / pool.path(e.m_id);
+		const boost::filesystem::path sib = dirp / _enc_sib(std::string(pool.str(e.m_id)), enc);
+		boost::filesystem::create_directories(sib.parent_path());
+		if (_file_compress(f, sib, enc) >= boost::filesystem::file_size(f))
+			boost::filesystem::remove(sib);
+	}
 }
 
 inline std::tuple<boost::filesystem::path, boost::filesystem::path>
-_tmp_move_tempname(const boost::filesystem::path &src, const boost::filesystem::path &dstroot)
+_tmp_copy_tempname(const boost::filesystem::path &src, const boost::filesystem::path &dstroot)
 {
 	boost::filesystem::path dstp = dstroot / boost::filesystem::unique_path();
-	boost::filesystem::rename(src, dstp);
+	_materialize(src, dstp);
 	return std::make_tuple(dstroot, boost::filesystem::relative(dstp, dstroot));
 }
 
@@ -211,6 +528,29 @@ _tmp_write_tempname(const std::string &data, const boost::filesystem::path &dstr
 	return std::make_tuple(dstroot, boost::filesystem::relative(dstp, dstroot));
 }
 
+/* streams path from psco into a fresh temp name under dstroot, failing (and leaving nothing behind) unless the
+   received content checksums to sha
+   partdir - download through a PsPart there instead, what an interrupted call received is continued by the next */
+inline std::tuple<boost::filesystem::path, boost::filesystem::path>
+_tmp_stream_tempname(PsCon &psco, const std::string &path, const ps_sha_t &sha, const boost::filesystem::path &dstroot, const boost::filesystem::path &partdir = boost::filesystem::path())
+{
+	boost::filesystem::path dstp = dstroot / boost::filesystem::unique_path();
+	if (!partdir.empty()) {
+		_part_download(psco, path, sha, partdir, dstp);
+		return std::make_tuple(dstroot, boost::filesystem::relative(dstp, dstroot));
+	}
+	try {
+		if (psco.req_file(path, "", dstp) != sha)
+			throw std::runtime_error("");
+	}
+	catch (...) {
+		boost::system::error_code ec;
+		boost::filesystem::remove(dstp, ec);
+		throw;
+	}
+	return std::make_tuple(dstroot, boost::filesystem::relative(dstp, dstroot));
+}
+
 inline void
 _tmp_write_filename(const std::string &data, const boost::filesystem::path &dst)
 {
@@ -219,29 +559,31 @@ _tmp_write_filename(const std::string &data, const boost::filesystem::path &dst)
 		throw std::runtime_error("");
 }
 
+/* runs fn(con, i) for every i < n over up to ndl connections cloned from psco, keeping ndl requests in flight
+   (psco itself, sequentially, when ndl is 1 or psco can not be cloned) */
 inline void
-_del_last_if_file(const boost::filesystem::path &path)
+_tmp_dl_each(PsCon &psco, size_t n, size_t ndl, const std::function<void(PsCon &, size_t)> &fn)
 {
-	for (auto cano = boost::filesystem::weakly_canonical(path); cano.has_parent_path(); cano = cano.parent_path())
-		if (boost::filesystem::exists(cano)) {
-			if (boost::filesystem::is_regular_file(cano))
-				boost::filesystem::remove(cano);
-			return;
-		}
-}
-
-inline std::tuple<boost::filesystem::path, boost::filesystem::path>
-_tmp_copy_force_makedst(const boost::filesystem::path &src, const boost::filesystem::path &dstroot, const boost::filesystem::path &dstrel)
-{
-	const char uniq_path_pattern[] = "pstmp%%%%-%%%%-%%%%-%%%%";
-	const auto &dstp = boost::filesystem::weakly_canonical(dstroot / dstrel);
-	assert(dstp.has_parent_path());
-	_del_last_if_file(dstp);
-	boost::filesystem::create_directories(dstp.parent_path());
-	if (boost::filesystem::exists(dstp))
-		boost::filesystem::rename(dstp, boost::filesystem::temp_directory_path() / boost::filesystem::unique_path(uniq_path_pattern));
-	boost::filesystem::copy_file(src, dstp, boost::filesystem::copy_option::fail_if_exists);
-	return std::make_tuple(dstroot, boost::filesystem::relative(dstp, dstroot));
+	std::vector<std::unique_ptr<PsCon> > cons;
+	for (size_t i = 0; ndl > 1 && i < std::min(ndl, n); i++) {
+		if (std::unique_ptr<PsCon> c = psco.clone(); c)
+			cons.push_back(std::move(c));
+		else
+			break;
+	}
+	if (cons.size() < 2) {
+		for (size_t i = 0; i < n; i++)
+			fn(psco, i);
+		return;
+	}
+	std::atomic<size_t> next(0);
+	PsPool pool(cons.size());
+	for (const auto &c : cons)
+		pool.post([&fn, &next, n, c = c.get()]() {
+			for (size_t i; (i = next++) < n;)
+				fn(*c, i);
+		});
+	pool.wait();
 }
 
 inline std::tuple<std::vector<boost::filesystem::path>, std::vector<ps_sha_t> >
@@ -250,80 +592,353 @@ _tmp_realdl(
 	const std::vector<ps_sha_t> dlsha,
 	const std::vector<boost::filesystem::path> &aux_fils,
 	const std::vector<ps_sha_t> &aux_sums,
-	PsCon &psco)
+	PsCon &psco,
+	size_t ndl = 1)
 {
-	std::map<ps_sha_t, boost::filesystem::path> dsf;
+	std::unordered_map<ps_sha_t, boost::filesystem::path> dsf;
 	for (const auto &[k, v] : ItPair(aux_fils, aux_sums))
 		dsf[v] = k;
 
-	std::vector<boost::filesystem::path> fils;
-	for (const auto &v : dlsha)
-		fils.push_back(std::get<1>(_tmp_write_tempname(psco.req(dsf.at(v).string(), "").body(), dstroot)));
+	std::vector<boost::filesystem::path> fils(dlsha.size());
+	_tmp_dl_each(psco, dlsha.size(), ndl, [&](PsCon &con, size_t i) {
+		fils[i] = std::get<1>(_tmp_stream_tempname(con, dsf.at(dlsha[i]).string(), dlsha[i], dstroot));
+	});
 
 	return std::make_tuple(fils, dlsha);
 }
 
+/* assembles the file with checksum sha (published at path) from the chunks of the local file localp,
+   fetching only the missing byte ranges - a result not matching sha is downloaded whole */
+inline boost::filesystem::path
+_tmp_cdc_tempname(
+	const boost::filesystem::path &dstroot,
+	const boost::filesystem::path &path,
+	const boost::filesystem::path &localp,
+	const ps_sha_t &sha,
+	const std::vector<PsChunk> &want,
+	PsCon &psco,
+	const boost::filesystem::path &partdir = boost::filesystem::path())
+{
+	std::unordered_map<ps_sha_t, PsChunk> have;
+	for (const auto &c : _fname_chunks(localp))
+		have.emplace(c.m_sha, c);
+
+	boost::filesystem::path dstp = dstroot / boost::filesystem::unique_path();
+	PsSha256 hash;
+	{
+		boost::filesystem::ifstream ifst = boost::filesystem::ifstream(localp, std::ios_base::in | std::ios_base::binary);
+		boost::filesystem::ofstream ofst = boost::filesystem::ofstream(dstp, std::ios_base::out | std::ios_base::binary);
+		const auto put = [&](const std::string &data) {
+			hash.update(data.data(), data.size());
+			if (!ofst.write(data.data(), data.size()))
+				throw std::runtime_error("");
+		};
+		for (size_t i = 0; i < want.size();) {
+			if (const auto h = have.find(want[i].m_sha); h != have.end()) {
+				std::string data(h->second.m_len, '\0');
+				if (!ifst.seekg(h->second.m_off) || !ifst.read(&data[0], data.size()))
+					throw std::runtime_error("");
+				put(data);
+				i++;
+				continue;
+			}
+			// coalesce a run of missing chunks into one ranged request
+			size_t j = i + 1;
+			while (j < want.size() && have.find(want[j].m_sha) == have.end())
+				j++;
+			put(psco.req_range(path.string(), "", want[i].m_off, want[j - 1].m_off + want[j - 1].m_len - want[i].m_off).body());
+			i = j;
+		}
+	}
+	if (hash.finish() != sha) {
+		boost::filesystem::remove(dstp);
+		return std::get<1>(_tmp_stream_tempname(psco, path.string(), sha, dstroot, partdir));
+	}
+	return boost::filesystem::relative(dstp, dstroot);
+}
+
+/* like _tmp_realdl, but files with a chunk manifest entry and a local file at the same path go through _tmp_cdc_tempname */
 inline std::tuple<std::vector<boost::filesystem::path>, std::vector<ps_sha_t> >
-_tmp_listfiledl(PsCon &psco)
+_tmp_realdl_cdc(
+	const boost::filesystem::path &dstroot,
+	const std::vector<ps_sha_t> dlsha,
+	const std::vector<boost::filesystem::path> &aux_fils,
+	const std::vector<ps_sha_t> &aux_sums,
+	const std::unordered_map<ps_sha_t, std::vector<PsChunk> > &chunks,
+	PsCon &psco,
+	size_t ndl = 1)
 {
-	std::vector<boost::filesystem::path> fils;
+	std::unordered_map<ps_sha_t, boost::filesystem::path> dsf;
+	for (const auto &[k, v] : ItPair(aux_fils, aux_sums))
+		dsf[v] = k;
+
+	std::vector<boost::filesystem::path> fils(dlsha.size());
+	_tmp_dl_each(psco, dlsha.size(), ndl, [&](PsCon &con, size_t i) {
+		const auto &path = dsf.at(dlsha[i]);
+		const auto it = chunks.find(dlsha[i]);
+		if (it == chunks.end() || !boost::filesystem::is_regular_file(dstroot / path))
+			fils[i] = std::get<1>(_tmp_stream_tempname(con, path.string(), dlsha[i], dstroot));
+		else
+			fils[i] = _tmp_cdc_tempname(dstroot, path, dstroot / path, dlsha[i], it->second, con);
+	});
+
+	return std::make_tuple(fils, dlsha);
+}
+
+/* download slots 0..n (goal path path(slot)) in the order they are started, with their class - highest class first,
+   in slot order within a class */
+inline std::vector<std::tuple<size_t, ps_prio_t> >
+_dl_order(const NupdOpt &opt, size_t n, const std::function<std::string_view(size_t)> &path)
+{
+	std::vector<std::tuple<size_t, ps_prio_t> > order;
+	for (size_t s = 0; s < n; s++)
+		order.push_back(std::make_tuple(s, opt.m_prio ? opt.m_prio(path(s)) : ps_prio_t::Normal));
+	std::stable_sort(order.begin(), order.end(), [](const auto &a, const auto &b) { return std::get<1>(a) > std::get<1>(b); });
+	return order;
+}
+
+/* the goal file path (checksum sha) into a temp name under stage, returned whole - from opt.m_store when it has sha,
+   assembled from local chunks when chunks lists sha and ourroot has a file at path, downloaded otherwise
+   (continuing a partial download) - what was not in the store is added to it */
+inline boost::filesystem::path
+_tmp_fetch_tempname(
+	PsCon &con,
+	const NupdOpt &opt,
+	const boost::filesystem::path &ourroot,
+	const boost::filesystem::path &stage,
+	const boost::filesystem::path &path,
+	const ps_sha_t &sha,
+	const std::unordered_map<ps_sha_t, std::vector<PsChunk> > &chunks)
+{
+	boost::filesystem::path dstp = stage / boost::filesystem::unique_path();
+	if (opt.m_store && opt.m_store->get(sha, dstp))
+		return dstp;
+	const auto it = chunks.find(sha);
+	if (it != chunks.end() && boost::filesystem::is_regular_file(ourroot / path))
+		dstp = stage / _tmp_cdc_tempname(stage, path, ourroot / path, sha, it->second, con, _part_path(ourroot));
+	else
+		dstp = stage / std::get<1>(_tmp_stream_tempname(con, path.string(), sha, stage, _part_path(ourroot)));
+	if (opt.m_store)
+		opt.m_store->put(sha, dstp);
+	return dstp;
+}
+
+inline std::unordered_map<ps_sha_t, std::vector<PsChunk> >
+_tmp_chunkfiledl(PsCon &psco)
+{
+	PsPrio prio(psco.m_prio, ps_prio_t::Critical);
+	std::unordered_map<ps_sha_t, std::vector<PsChunk> > chunks;
+	for (const auto &v : _re_getline(psco.req("listfile.pscl", "").body())) {
+		if (v.empty())
+			continue;
+		std::stringstream ss(v);
+		ps_sha_t sha;
+		PsChunk c;
+		if (!(ss >> sha >> c.m_off >> c.m_len >> c.m_sha) || !ss.eof())
+			throw std::runtime_error("");
+		auto &cs = chunks[sha];
+		if (c.m_off != (cs.size() ? cs.back().m_off + cs.back().m_len : 0))
+			throw std::runtime_error("");
+		cs.push_back(c);
+	}
+	return chunks;
+}
+
+inline std::tuple<std::vector<PsStrPool::id_t>, std::vector<ps_sha_t> >
+_tmp_listfile_text(const std::string &listfile, PsStrPool &pool)
+{
+	std::vector<PsStrPool::id_t> ids;
 	std::vector<ps_sha_t> sums;
-	std::string listfile = psco.req("listfile.psli", "").body();
-	std::stringstream ss;
-	if (!(ss << listfile))
-		throw std::runtime_error("");
 	for (const auto &v : _re_getline(listfile)) {
-		std::stringstream ss_;
-		if (!(ss_ << v))
-			throw std::runtime_error("");
-		std::string fna, sum;
-		std::getline(ss_, fna, ' ');
-		std::getline(ss_, sum);
-		if (!ss_.eof())
+		const std::string_view line(v);
+		const size_t sp = line.find(' ');
+		if (sp == std::string_view::npos)
 			throw std::runtime_error("");
-		fils.push_back(fna);
-		sums.push_back(sum);
+		ids.push_back(pool.intern(line.substr(0, sp)));
+		sums.push_back(ps_sha_t::from_hex(line.substr(sp + 1)));
 	}
-	return std::make_tuple(fils, sums);
+	return std::make_tuple(ids, sums);
 }
 
-inline int
-_main(const boost::filesystem::path &ourroot, PsCon &psco)
+inline std::tuple<std::vector<PsStrPool::id_t>, std::vector<ps_sha_t> >
+_tmp_listfile_bin(const std::string &listfile, PsStrPool &pool)
 {
-	const auto &[goal_fils, goal_sums] = _tmp_listfiledl(psco);
-	auto [beg_fils, beg_sums] = _dir_checksum(ourroot);
+	const PsBinList list(listfile.data(), listfile.size());
+	std::vector<PsStrPool::id_t> ids;
+	std::vector<ps_sha_t> sums;
+	ids.reserve(list.size());
+	sums.reserve(list.size());
+	for (size_t i = 0; i < list.size(); i++) {
+		ids.push_back(pool.intern(list.path(i)));
+		sums.push_back(ps_sha_t::from_bin(list.sha(i)));
+	}
+	return std::make_tuple(ids, sums);
+}
 
-	std::vector<ps_sha_t> miss_sums = _missing_checksum(beg_sums, goal_sums);
+inline std::tuple<std::vector<boost::filesystem::path>, std::vector<ps_sha_t> >
+_tmp_listfiledl(PsCon &psco)
+{
+	PsStrPool pool;
+	auto [ids, sums] = _tmp_listfile_text(psco.req("listfile.psli", "").body(), pool);
+	return std::make_tuple(_pool_paths(pool, ids), std::move(sums));
+}
 
-	if (miss_sums.size()) {
-		auto [dl_fils, dl_sums] = _tmp_realdl(ourroot, miss_sums, goal_fils, goal_sums, psco);
-		std::copy(dl_fils.begin(), dl_fils.end(), std::back_inserter(beg_fils));
-		std::copy(dl_sums.begin(), dl_sums.end(), std::back_inserter(beg_sums));
+inline std::tuple<std::vector<PsStrPool::id_t>, std::vector<ps_sha_t> >
+_tmp_listfiledl(PsCon &psco, const NupdOpt &opt, PsStrPool &pool)
+{
+	PsPrio prio(psco.m_prio, ps_prio_t::Critical);
+	std::string listfile;
+	if (opt.m_listbin) {
+		try {
+			listfile = psco.req("listfile.psbl", "").body();
+		}
+		catch (std::exception &) {
+			return _tmp_listfile_text(psco.req("listfile.psli", "").body(), pool);
+		}
+		return _tmp_listfile_bin(listfile, pool);
 	}
-		
-	nupdd_t dd = NupdD::mk(beg_fils, beg_sums, goal_fils, goal_sums);
+	return _tmp_listfile_text(psco.req("listfile.psli", "").body(), pool);
+}
 
-	std::vector<std::tuple<boost::filesystem::path, boost::filesystem::path> > work;
-	std::vector<boost::filesystem::path> work2;
+/* _main as a staged pipeline
+     listfile fetch || local scan
+     download of missing checksums (m_ndl in flight) || staging copies of local content (PsDiff::m_copy)
+     -> bounded queue -> staging copies of each download as it lands (PsDiff::m_dl_goal)
+     PsApply::commit
+   the diff needs the whole scan, so no download starts before it ends - wall-clock is
+   max(listfile, scan) + max(download, apply) rather than the sum of all the stages */
+inline int
+_main_pipe(const boost::filesystem::path &ourroot, PsCon &psco, const NupdOpt &opt = NupdOpt())
+{
+	NupdStat stat_;
+	NupdStat &stat = opt.m_stat ? *opt.m_stat : stat_;
+
+	PsApply apply(ourroot);
+
+	// the listfile fetch and the scan intern concurrently - one pool each
+	PsStrPool beg_pool, goal_pool;
+	auto goal_fut = std::async(std::launch::async, [&]() {
+		stat.beg(NupdStat::Listfile);
+		auto r = _tmp_listfiledl(psco, opt, goal_pool);
+		stat.m_n[NupdStat::Listfile] = std::get<0>(r).size();
+		stat.end(NupdStat::Listfile);
+		return r;
+	});
+	stat.beg(NupdStat::Scan);
+	std::vector<PsStrPool::id_t> beg_ids, goal_ids;
+	std::vector<ps_sha_t> beg_sums, goal_sums;
+	std::tie(beg_ids, beg_sums) = _dir_checksum(ourroot, opt, beg_pool);
+	stat.m_n[NupdStat::Scan] = beg_ids.size();
+	stat.end(NupdStat::Scan);
+	std::tie(goal_ids, goal_sums) = goal_fut.get();
+
+	stat.beg(NupdStat::Apply);
+	const PsDiff diff = PsDiff::mk(beg_pool, beg_ids, beg_sums, goal_pool, goal_ids, goal_sums);
+
+	PsQueue<std::tuple<size_t, boost::filesystem::path> > q(opt.m_pipe_depth);
+	auto dl_fut = std::async(std::launch::async, [&]() {
+		try {
+			stat.beg(NupdStat::Download);
+			const auto chunks = opt.m_cdc && diff.m_dl.size() ? _tmp_chunkfiledl(psco) : std::unordered_map<ps_sha_t, std::vector<PsChunk> >();
+			const auto order = _dl_order(opt, diff.m_dl.size(), [&](size_t s) { return goal_pool.str(goal_ids[diff.m_dl[s]]); });
+			_tmp_dl_each(psco, order.size(), opt.m_ndl, [&](PsCon &con, size_t k) {
+				const auto [s, p] = order[k];
+				PsPrio prio(con.m_prio, p);
+				const PsDiff::idx_t g = diff.m_dl[s];
+				const auto dstp = _tmp_fetch_tempname(con, opt, ourroot, apply.m_stage, goal_pool.path(goal_ids[g]), goal_sums[g], chunks);
+				stat.m_n[NupdStat::Download]++;
+				if (!q.push(std::make_tuple(s, dstp)))
+					throw std::runtime_error("");
+			});
+			stat.end(NupdStat::Download);
+		}
+		catch (...) {
+			q.close();
+			throw;
+		}
+		q.close();
+	});
 
-	std::map<ps_sha_t, boost::filesystem::path> dsf;
-	for (const auto &[k, v] : ItPair(beg_fils, beg_sums))
-		dsf[v] = k;
+	try {
+		for (const auto &[g, b] : diff.m_copy) {
+			_materialize(ourroot / beg_pool.path(beg_ids[b]), apply.add(goal_pool.path(goal_ids[g])), opt.m_hardlink);
+			stat.m_n[NupdStat::Apply]++;
+		}
+		for (std::tuple<size_t, boost::filesystem::path> v; q.pop(v);) {
+			const size_t s = std::get<0>(v);
+			for (size_t i = diff.m_dl_off[s] + 1; i < diff.m_dl_off[s + 1]; i++)
+				_materialize(std::get<1>(v), apply.add(goal_pool.path(goal_ids[diff.m_dl_goal[i]])), opt.m_hardlink);
+			boost::filesystem::rename(std::get<1>(v), apply.add(goal_pool.path(goal_ids[diff.m_dl_goal[diff.m_dl_off[s]]])));
+			stat.m_n[NupdStat::Apply] += diff.m_dl_off[s + 1] - diff.m_dl_off[s];
+		}
+	}
+	catch (...) {
+		q.close();
+		dl_fut.wait();
+		throw;
+	}
+	dl_fut.get();
+	apply.commit();
+	boost::filesystem::remove_all(_part_path(ourroot));
+	if (opt.m_store)
+		opt.m_store->trim();
+	stat.end(NupdStat::Apply);
 
-	for (const auto &[k, v] : dd)
-		if (v.m_a.size() && v.m_b.size() && v.m_a != v.m_b)
-			work.push_back(std::make_tuple(k, std::get<1>(_tmp_move_tempname(ourroot / k, ourroot))));
-	for (const auto &[k, rel] : work)
-		NupdD::xform_AB_AN__XX_NB(dd[k], dd[rel]);
+	for (const auto &[k, v] : ItPair(goal_ids, goal_sums))
+		assert(_fname_checksum(ourroot / goal_pool.path(k)) == v);
 
-	for (const auto &[k, v] : dd)
-		if (v.m_a.size() && !v.m_b.size())
-			work2.push_back(std::get<1>(_tmp_copy_force_makedst(ourroot / dsf.at(v.m_a), ourroot, k)));
-	for (const auto &k : work2)
-		NupdD::xform_AN_AA(dd.at(k));
+	return EXIT_SUCCESS;
+}
 
-	for (const auto &[k, v] : ItPair(goal_fils, goal_sums))
-		assert(_fname_checksum(ourroot / k) == v);
+/* one update session - every path of the session (scan, listfile, plan) is interned in a single PsStrPool
+   and released with it, fs paths are only formed transiently around each filesystem call
+   every write is staged then committed through PsApply, so copy sources and chunked download bases are read
+   from the tree as scanned */
+inline int
+_main(const boost::filesystem::path &ourroot, PsCon &psco, const NupdOpt &opt = NupdOpt())
+{
+	if (opt.m_pipe)
+		return _main_pipe(ourroot, psco, opt);
+
+	PsApply apply(ourroot);
+
+	PsStrPool pool;
+	std::vector<PsStrPool::id_t> beg_ids, goal_ids;
+	std::vector<ps_sha_t> beg_sums, goal_sums;
+	std::tie(goal_ids, goal_sums) = _tmp_listfiledl(psco, opt, pool);
+	std::tie(beg_ids, beg_sums) = _dir_checksum(ourroot, opt, pool);
+
+	const PsDiff diff = PsDiff::mk(pool, beg_ids, beg_sums, pool, goal_ids, goal_sums);
+
+	std::vector<boost::filesystem::path> dl_fils(diff.m_dl.size());
+	if (diff.m_dl.size()) {
+		const auto chunks = opt.m_cdc ? _tmp_chunkfiledl(psco) : std::unordered_map<ps_sha_t, std::vector<PsChunk> >();
+		const auto order = _dl_order(opt, diff.m_dl.size(), [&](size_t s) { return pool.str(goal_ids[diff.m_dl[s]]); });
+		_tmp_dl_each(psco, order.size(), opt.m_ndl, [&](PsCon &con, size_t k) {
+			const auto [s, p] = order[k];
+			PsPrio prio(con.m_prio, p);
+			dl_fils[s] = _tmp_fetch_tempname(con, opt, ourroot, apply.m_stage, pool.path(goal_ids[diff.m_dl[s]]), goal_sums[diff.m_dl[s]], chunks);
+		});
+	}
+
+	for (const auto &[g, b] : diff.m_copy)
+		_materialize(ourroot / pool.path(beg_ids[b]), apply.add(pool.path(goal_ids[g])), opt.m_hardlink);
+	// every goal path of a download but the first gets a copy, the first takes the download itself
+	for (size_t s = 0; s < diff.m_dl.size(); s++) {
+		for (size_t i = diff.m_dl_off[s] + 1; i < diff.m_dl_off[s + 1]; i++)
+			_materialize(dl_fils[s], apply.add(pool.path(goal_ids[diff.m_dl_goal[i]])), opt.m_hardlink);
+		boost::filesystem::rename(dl_fils[s], apply.add(pool.path(goal_ids[diff.m_dl_goal[diff.m_dl_off[s]]])));
+	}
+	apply.commit();
+	// partials of files no longer wanted
+	boost::filesystem::remove_all(_part_path(ourroot));
+	if (opt.m_store)
+		opt.m_store->trim();
+
+	for (const auto &[k, v] : ItPair(goal_ids, goal_sums))
+		assert(_fname_checksum(ourroot / pool.path(k)) == v);
 
 	return EXIT_SUCCESS;
 }
+
+#endif /* _PSNUPD_HPP_ */
@@ -0,0 +1,106 @@
+#ifndef _PSPART_HPP_
+#define _PSPART_HPP_
+
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+#include <pscon.hpp>
+#include <psfs.hpp>
+
+/* partial downloads (<statedir>/part) - survive an interrupted update, the next one continues them where they stopped */
+inline boost::filesystem::path
+_part_path(const boost::filesystem::path &ourroot)
+{
+	return _statedir(ourroot) / "part";
+}
+
+/* a download of the file with checksum sha - <partdir>/<sha hex> holds its first m_sha.m_len bytes,
+   <partdir>/<sha hex>.ck the hash state over them followed by the validator of the version they came from
+   a checkpoint is written only after the bytes it covers are on disk, a file longer than its checkpoint
+   (the bytes received after it) is cut back to it on load, a missing or unreadable checkpoint starts over */
+class PsPart
+{
+public:
+	inline PsPart(const boost::filesystem::path &partdir, const ps_sha_t &sha) :
+		m_file(partdir / sha.hex()),
+		m_ck(partdir / (sha.hex() + ".ck")),
+		m_sha(),
+		m_validator()
+	{
+		boost::filesystem::create_directories(partdir);
+		try {
+			const std::string ck = _readfile(m_ck);
+			if (ck.size() < 105)
+				throw std::runtime_error("");
+			m_sha.restore(ck.substr(0, 105));
+			m_validator = ck.substr(105);
+			if (boost::filesystem::file_size(m_file) < m_sha.m_len)
+				throw std::runtime_error("");
+			boost::filesystem::resize_file(m_file, m_sha.m_len);
+		}
+		catch (std::exception &) {
+			m_sha = PsSha256();
+			m_validator.clear();
+		}
+	}
+
+	/* the file flushed up to m_sha.m_len */
+	inline void
+	save()
+	{
+		_fsync_path(m_file);
+		_write_file_atomic(m_sha.save() + m_validator, m_ck);
+	}
+
+	inline void
+	drop()
+	{
+		boost::system::error_code ec;
+		boost::filesystem::remove(m_ck, ec);
+		boost::filesystem::remove(m_file, ec);
+	}
+
+	boost::filesystem::path m_file;
+	boost::filesystem::path m_ck;
+	PsSha256 m_sha;
+	std::string m_validator;
+};
+
+/* path from psco into dst by way of a PsPart - continued if an earlier call was interrupted, failing unless the
+   content checksums to sha
+   an interrupted call keeps what it received (up to the last byte written) if the source named its version */
+inline void
+_part_download(PsCon &psco, const std::string &path, const ps_sha_t &sha, const boost::filesystem::path &partdir, const boost::filesystem::path &dst)
+{
+	PsPart part(partdir, sha);
+	try {
+		psco.req_file_resume(path, "", part.m_file, part.m_sha, part.m_validator, [&]() { part.save(); });
+	}
+	catch (...) {
+		boost::system::error_code ec;
+		const uint64_t have = boost::filesystem::file_size(part.m_file, ec);
+		try {
+			if (ec || have < part.m_sha.m_len || part.m_validator.empty())
+				throw std::runtime_error("");
+			boost::filesystem::resize_file(part.m_file, part.m_sha.m_len);
+			part.save();
+		}
+		catch (std::exception &) {
+			part.drop();
+		}
+		throw;
+	}
+	if (part.m_sha.finish() != sha) {
+		part.drop();
+		throw std::runtime_error("");
+	}
+	boost::filesystem::rename(part.m_file, dst);
+	part.drop();
+}
+
+#endif /* _PSPART_HPP_ */
@@ -0,0 +1,219 @@
+#ifndef _PSPOOL_HPP_
+#define _PSPOOL_HPP_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* work-stealing thread pool
+     - tasks posted from outside the pool go to a shared fifo (posting order is kept, used for largest-first scheduling)
+     - tasks posted by a running task go to the posting worker's own deque (lifo for the owner)
+     - an idle worker takes from its own deque, then the shared fifo, then steals the oldest task of another worker
+   the first exception thrown by a task is rethrown from wait() */
+class PsPool
+{
+public:
+	using task_t = std::function<void()>;
+
+	class Q
+	{
+	public:
+		std::mutex m_mtx;
+		std::deque<task_t> m_d;
+	};
+
+	inline PsPool(size_t nthread) :
+		m_q(),
+		m_inject(),
+		m_mtx(),
+		m_cv(),
+		m_cv_idle(),
+		m_queued(0),
+		m_pending(0),
+		m_stop(false),
+		m_e(),
+		m_t()
+	{
+		if (!nthread)
+			nthread = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+		for (size_t i = 0; i < nthread; i++)
+			m_q.push_back(std::make_unique<Q>());
+		for (size_t i = 0; i < nthread; i++)
+			m_t.emplace_back(std::bind(&PsPool::_run, this, i));
+	}
+
+	inline ~PsPool()
+	{
+		{
+			std::lock_guard<std::mutex> l(m_mtx);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (auto &t : m_t)
+			t.join();
+	}
+
+	inline size_t
+	size() const
+	{
+		return m_t.size();
+	}
+
+	inline void
+	post(task_t f)
+	{
+		Q &q = _self().first == this ? *m_q.at(_self().second) : m_inject;
+		{
+			std::lock_guard<std::mutex> l(m_mtx);
+			m_queued++;
+			m_pending++;
+		}
+		{
+			std::lock_guard<std::mutex> l(q.m_mtx);
+			q.m_d.push_back(std::move(f));
+		}
+		m_cv.notify_one();
+	}
+
+	inline void
+	wait()
+	{
+		std::unique_lock<std::mutex> l(m_mtx);
+		m_cv_idle.wait(l, [&]() { return m_pending == 0; });
+		if (std::exception_ptr e = m_e) {
+			m_e = nullptr;
+			std::rethrow_exception(e);
+		}
+	}
+
+	inline static std::pair<PsPool *, size_t> &
+	_self()
+	{
+		thread_local std::pair<PsPool *, size_t> self(nullptr, 0);
+		return self;
+	}
+
+	inline bool
+	_take(size_t idx, task_t &f)
+	{
+		const auto pop = [&](Q &q, bool back) {
+			std::lock_guard<std::mutex> l(q.m_mtx);
+			if (q.m_d.empty())
+				return false;
+			f = std::move(back ? q.m_d.back() : q.m_d.front());
+			back ? q.m_d.pop_back() : q.m_d.pop_front();
+			return true;
+		};
+		if (pop(*m_q[idx], true) || pop(m_inject, false))
+			return true;
+		for (size_t i = 1; i < m_q.size(); i++)
+			if (pop(*m_q[(idx + i) % m_q.size()], false))
+				return true;
+		return false;
+	}
+
+	inline void
+	_run(size_t idx)
+	{
+		_self() = std::make_pair(this, idx);
+		for (task_t f;;) {
+			if (_take(idx, f)) {
+				{
+					std::lock_guard<std::mutex> l(m_mtx);
+					m_queued--;
+				}
+				try {
+					f();
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> l(m_mtx);
+					if (!m_e)
+						m_e = std::current_exception();
+				}
+				f = nullptr;
+				std::lock_guard<std::mutex> l(m_mtx);
+				if (!--m_pending)
+					m_cv_idle.notify_all();
+				continue;
+			}
+			std::unique_lock<std::mutex> l(m_mtx);
+			m_cv.wait(l, [&]() { return m_stop || m_queued > 0; });
+			if (m_stop && m_queued <= 0)
+				return;
+		}
+	}
+
+	std::vector<std::unique_ptr<Q> > m_q;
+	Q m_inject;
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::condition_variable m_cv_idle;
+	int64_t m_queued;
+	size_t m_pending;
+	bool m_stop;
+	std::exception_ptr m_e;
+	std::vector<std::thread> m_t;
+};
+
+/* bounded blocking queue between pipeline stages
+   push blocks while full, pop blocks while empty - after close() push fails and pop drains what is left */
+template<typename T>
+class PsQueue
+{
+public:
+	inline PsQueue(size_t cap) :
+		m_cap(std::max<size_t>(cap, 1)),
+		m_mtx(),
+		m_cv(),
+		m_d(),
+		m_closed(false)
+	{}
+
+	inline bool
+	push(T v)
+	{
+		std::unique_lock<std::mutex> l(m_mtx);
+		m_cv.wait(l, [&]() { return m_closed || m_d.size() < m_cap; });
+		if (m_closed)
+			return false;
+		m_d.push_back(std::move(v));
+		m_cv.notify_all();
+		return true;
+	}
+
+	inline bool
+	pop(T &v)
+	{
+		std::unique_lock<std::mutex> l(m_mtx);
+		m_cv.wait(l, [&]() { return m_closed || !m_d.empty(); });
+		if (m_d.empty())
+			return false;
+		v = std::move(m_d.front());
+		m_d.pop_front();
+		m_cv.notify_all();
+		return true;
+	}
+
+	inline void
+	close()
+	{
+		std::lock_guard<std::mutex> l(m_mtx);
+		m_closed = true;
+		m_cv.notify_all();
+	}
+
+	size_t m_cap;
+	std::mutex m_mtx;
+	std::condition_variable m_cv;
+	std::deque<T> m_d;
+	bool m_closed;
+};
+
+#endif /* _PSPOOL_HPP_ */
@@ -0,0 +1,171 @@
+#ifndef _PSSTORE_HPP_
+#define _PSSTORE_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <hasher.hpp>
+#include <psfs.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* content-addressed object store shared by several installs (and updater processes) on one host
+   objects are <dir>/<first two hex digits>/<sha hex>, written under <dir>/tmp then renamed into place, so an
+   object that exists is complete - only content whose checksum was verified is put
+   an object's mtime is its last use, trim evicts least recently used objects down to m_max bytes
+   get and put hold a shared flock on <dir>/lock, trim an exclusive one - an object is never evicted while
+   another process materializes from it
+   get never links an object into an install - the use stamp on the object would change the installed file's stat
+   (invalidating its PsHashCache entry) and a write in place would corrupt the object - what get produced is
+   verified against sha, a damaged object is evicted */
+class PsStore
+{
+public:
+	inline PsStore(const boost::filesystem::path &dir, uint64_t max = 0) :
+		m_dir(dir),
+		m_max(max)
+	{
+		boost::filesystem::create_directories(m_dir / "tmp");
+	}
+
+	/* flock on <dir>/lock for the lifetime of the object - a no-op without flock */
+	class Lock
+	{
+	public:
+		inline Lock(const boost::filesystem::path &dir, bool excl) :
+			m_fd(-1)
+		{
+#ifdef __linux__
+			if ((m_fd = ::open((dir / "lock").c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0644)) < 0)
+				throw std::runtime_error("");
+			if (::flock(m_fd, excl ? LOCK_EX : LOCK_SH) != 0) {
+				::close(m_fd);
+				throw std::runtime_error("");
+			}
+#endif
+		}
+
+		inline ~Lock()
+		{
+#ifdef __linux__
+			::close(m_fd);
+#endif
+		}
+
+		Lock(const Lock &) = delete;
+		Lock &operator=(const Lock &) = delete;
+
+		int m_fd;
+	};
+
+	inline boost::filesystem::path
+	_obj(const ps_sha_t &sha) const
+	{
+		const std::string hex = sha.hex();
+		return m_dir / hex.substr(0, 2) / hex;
+	}
+
+	/* marks obj used now */
+	inline static void
+	_touch(const boost::filesystem::path &obj)
+	{
+#ifdef __linux__
+		::utimensat(AT_FDCWD, obj.c_str(), nullptr, 0);
+#else
+		boost::system::error_code ec;
+		boost::filesystem::last_write_time(obj, std::time(nullptr), ec);
+#endif
+	}
+
+	/* creates dst with the content sha (a reflink or copy of the object) - false, leaving no dst, if the store
+	   does not have it or its object is damaged */
+	inline bool
+	get(const ps_sha_t &sha, const boost::filesystem::path &dst)
+	{
+		Lock l(m_dir, false);
+		const boost::filesystem::path obj = _obj(sha);
+		if (!boost::filesystem::is_regular_file(obj))
+			return false;
+		_materialize(obj, dst);
+		if (_fname_checksum(dst) != sha) {
+			boost::filesystem::remove(dst);
+			boost::system::error_code ec;
+			boost::filesystem::remove(obj, ec);
+			return false;
+		}
+		_touch(obj);
+		return true;
+	}
+
+	/* adds src, whose content is known to checksum to sha
+	   hardlink - the object may take src's inode, only for a src nobody keeps (removed by the caller after) */
+	inline void
+	put(const ps_sha_t &sha, const boost::filesystem::path &src, bool hardlink = false)
+	{
+		Lock l(m_dir, false);
+		const boost::filesystem::path obj = _obj(sha);
+		if (boost::filesystem::is_regular_file(obj))
+			return _touch(obj);
+		const boost::filesystem::path tmp = m_dir / "tmp" / boost::filesystem::unique_path();
+		try {
+			_materialize(src, tmp, hardlink);
+			boost::filesystem::create_directories(obj.parent_path());
+			boost::filesystem::rename(tmp, obj);
+		}
+		catch (...) {
+			boost::system::error_code ec;
+			boost::filesystem::remove(tmp, ec);
+			throw;
+		}
+	}
+
+	/* evicts least recently used objects until the store holds at most m_max bytes (0 - unbounded), returns
+	   the bytes held after - temporaries of interrupted puts go too, anything but a regular file is left alone */
+	inline uint64_t
+	trim()
+	{
+		Lock l(m_dir, true);
+		boost::filesystem::remove_all(m_dir / "tmp");
+		boost::filesystem::create_directories(m_dir / "tmp");
+		std::vector<std::tuple<std::time_t, uint64_t, boost::filesystem::path> > objs;
+		uint64_t total = 0;
+		for (boost::filesystem::directory_iterator it(m_dir); it != boost::filesystem::directory_iterator(); ++it) {
+			if (!boost::filesystem::is_directory(it->path()) || it->path().filename().string().size() != 2)
+				continue;
+			for (boost::filesystem::directory_iterator jt(it->path()); jt != boost::filesystem::directory_iterator(); ++jt) {
+				if (jt->symlink_status().type() != boost::filesystem::regular_file)
+					continue;
+				const uint64_t size = boost::filesystem::file_size(jt->path());
+				objs.push_back(std::make_tuple(boost::filesystem::last_write_time(jt->path()), size, jt->path()));
+				total += size;
+			}
+		}
+		if (!m_max || total <= m_max)
+			return total;
+		std::sort(objs.begin(), objs.end());
+		for (const auto &[t, size, p] : objs) {
+			if (total <= m_max)
+				break;
+			boost::filesystem::remove(p);
+			total -= size;
+		}
+		return total;
+	}
+
+	boost::filesystem::path m_dir;
+	uint64_t m_max;
+};
+
+#endif /* _PSSTORE_HPP_ */
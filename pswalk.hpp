@@ -0,0 +1,175 @@
+#ifndef _PSWALK_HPP_
+#define _PSWALK_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include <psarena.hpp>
+#include <psfs.hpp>
+#include <pspool.hpp>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* a regular file found by _dir_walk - its relative generic path (interned) and its stat, taken during the walk */
+class PsWalkEnt
+{
+public:
+	PsStrPool::id_t m_id;
+	PsStat m_st;
+};
+
+using ps_walk_raw_t = std::vector<std::tuple<std::string, PsStat> >;
+
+#ifdef __linux__
+
+/* the record layout getdents64 fills in */
+struct ps_dirent64_t
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/* lists one directory (rel, relative to rootfd - empty for the root itself) with getdents64
+   d_type sorts entries without a stat, regular files then get a single fstatat for their metadata
+   symlinks count as the file they point to (dangling ones and links to directories are skipped, as with
+   recursive_directory_iterator + is_regular_file), DT_UNKNOWN (some network filesystems) falls back to an lstat */
+inline void
+_dir_walk_one(int rootfd, const std::string &rel, ps_walk_raw_t &fils, std::vector<std::string> &dirs)
+{
+	const int fd = ::openat(rootfd, rel.empty() ? "." : rel.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("");
+	try {
+		alignas(8) char buf[32 * 1024];
+		for (long n; (n = ::syscall(SYS_getdents64, fd, buf, sizeof buf)) != 0;) {
+			if (n < 0)
+				throw std::runtime_error("");
+			for (long off = 0; off < n;) {
+				const ps_dirent64_t *d = (const ps_dirent64_t *) (buf + off);
+				off += d->d_reclen;
+				const char *name = d->d_name;
+				if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+					continue;
+				unsigned char type = d->d_type;
+				struct stat st = {};
+				if (type == DT_UNKNOWN) {
+					if (::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+						throw std::runtime_error("");
+					type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+				}
+				else if (type == DT_REG) {
+					if (::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+						throw std::runtime_error("");
+				}
+				if (type == DT_LNK && (::fstatat(fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode)))
+					continue;
+				if (type == DT_DIR)
+					dirs.push_back(rel.empty() ? std::string(name) : rel + "/" + name);
+				else if (type == DT_REG || type == DT_LNK) {
+					fils.push_back(std::make_tuple(rel.empty() ? std::string(name) : rel + "/" + name, _stat_conv(st)));
+					std::get<1>(fils.back()).m_link = type == DT_LNK;
+				}
+			}
+		}
+	}
+	catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+}
+
+inline ps_walk_raw_t
+_dir_walk_raw(const boost::filesystem::path &dirp, size_t nthread)
+{
+	const int rootfd = ::open(dirp.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (rootfd < 0)
+		throw std::runtime_error("");
+	ps_walk_raw_t all;
+	try {
+		if (nthread == 1) {
+			std::vector<std::string> todo(1);
+			while (todo.size()) {
+				const std::string rel = std::move(todo.back());
+				todo.pop_back();
+				_dir_walk_one(rootfd, rel, all, todo);
+			}
+		}
+		else {
+			// one task per directory, subdirectories are posted from the worker that found them
+			std::mutex mtx;
+			PsPool pool(nthread);
+			std::function<void(const std::string &)> visit = [&](const std::string &rel) {
+				ps_walk_raw_t fils;
+				std::vector<std::string> dirs;
+				_dir_walk_one(rootfd, rel, fils, dirs);
+				for (auto &d : dirs)
+					pool.post([&visit, d = std::move(d)]() { visit(d); });
+				std::lock_guard<std::mutex> l(mtx);
+				std::move(fils.begin(), fils.end(), std::back_inserter(all));
+			};
+			pool.post([&]() { visit(std::string()); });
+			pool.wait();
+		}
+	}
+	catch (...) {
+		::close(rootfd);
+		throw;
+	}
+	::close(rootfd);
+	return all;
+}
+
+#else /* __linux__ */
+
+inline ps_walk_raw_t
+_dir_walk_raw(const boost::filesystem::path &dirp, size_t nthread)
+{
+	const size_t pre = (dirp / "x").generic_string().size() - 1;
+	ps_walk_raw_t all;
+	for (auto it = boost::filesystem::recursive_directory_iterator(dirp); it != boost::filesystem::recursive_directory_iterator(); ++it)
+		if (boost::filesystem::is_regular_file(it->path())) {
+			all.push_back(std::make_tuple(it->path().generic_string().substr(pre), _fname_stat(it->path())));
+			std::get<1>(all.back()).m_link = boost::filesystem::is_symlink(it->path());
+		}
+	return all;
+}
+
+#endif /* __linux__ */
+
+/* regular files under dirp, sorted bytewise by relative generic path, with the metadata hash cache checks need
+   subdirectories are listed concurrently on nthread threads (0 - one per core, 1 - inline)
+   the result, including the order in which paths are interned into pool, does not depend on nthread */
+inline std::vector<PsWalkEnt>
+_dir_walk(const boost::filesystem::path &dirp, PsStrPool &pool, size_t nthread = 1)
+{
+	ps_walk_raw_t all = _dir_walk_raw(dirp, nthread);
+	std::sort(all.begin(), all.end(), [](const auto &a, const auto &b) { return std::get<0>(a) < std::get<0>(b); });
+	std::vector<PsWalkEnt> ents;
+	ents.reserve(all.size());
+	for (const auto &[rel, st] : all)
+		ents.push_back(PsWalkEnt{ pool.intern(rel), st });
+	return ents;
+}
+
+#endif /* _PSWALK_HPP_ */
@@ -0,0 +1,265 @@
+#ifndef _PSZIP_HPP_
+#define _PSZIP_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <boost/filesystem.hpp>
+
+#include <zlib.h>
+
+#ifdef PS_USE_ZSTD
+#include <zstd.h>
+#endif
+
+/* content codings of a transfer - Gzip through zlib, Zstd only in builds with PS_USE_ZSTD */
+enum class ps_enc_t { Identity, Gzip, Zstd };
+
+/* Accept-Encoding naming what this build decodes, best first */
+inline const char *
+_enc_accept()
+{
+#ifdef PS_USE_ZSTD
+	return "zstd, gzip";
+#else
+	return "gzip";
+#endif
+}
+
+/* the coding the publisher writes pre-compressed siblings in */
+inline ps_enc_t
+_enc_best()
+{
+#ifdef PS_USE_ZSTD
+	return ps_enc_t::Zstd;
+#else
+	return ps_enc_t::Gzip;
+#endif
+}
+
+/* Content-Encoding value - throws for codings this build can not decode */
+inline ps_enc_t
+_enc_parse(std::string_view v)
+{
+	if (v.empty() || v == "identity")
+		return ps_enc_t::Identity;
+	if (v == "gzip" || v == "x-gzip")
+		return ps_enc_t::Gzip;
+#ifdef PS_USE_ZSTD
+	if (v == "zstd")
+		return ps_enc_t::Zstd;
+#endif
+	throw std::runtime_error("");
+}
+
+/* file name extension of a pre-compressed sibling ("a.txt" -> "a.txt.gz") */
+inline std::string
+_enc_ext(ps_enc_t enc)
+{
+	switch (enc) {
+	case ps_enc_t::Gzip: return ".gz";
+	case ps_enc_t::Zstd: return ".zst";
+	default: return std::string();
+	}
+}
+
+/* the directory at the root of a published tree holding the pre-compressed siblings - not part of the tree
+   (see _dir_walk), so a sibling never shadows or is shadowed by a published file */
+inline const char *
+_enc_sibdir()
+{
+	return ".pszip";
+}
+
+/* relative path of the sibling of path in coding enc ("a.txt" -> ".pszip/a.txt.gz"), path itself for Identity */
+inline std::string
+_enc_sib(const std::string &path, ps_enc_t enc)
+{
+	if (enc == ps_enc_t::Identity)
+		return path;
+	return std::string(_enc_sibdir()) + "/" + path + _enc_ext(enc);
+}
+
+/* streaming decoder - compressed input goes in piecewise through update, the decoded output comes out through
+   out(data, len) in pieces of up to s_buf bytes, never held whole
+   finish throws unless the input was exactly one complete stream */
+class PsInflate
+{
+public:
+	inline static const size_t s_buf = 64 * 1024;
+
+	inline PsInflate(ps_enc_t enc) :
+		m_enc(enc),
+		m_z(),
+		m_end(enc == ps_enc_t::Identity),
+		m_buf(new unsigned char[s_buf])
+	{
+		if (m_enc == ps_enc_t::Gzip && ::inflateInit2(&m_z, 15 + 16) != Z_OK)
+			throw std::runtime_error("");
+#ifdef PS_USE_ZSTD
+		if (m_enc == ps_enc_t::Zstd && !(m_zs = ::ZSTD_createDStream()))
+			throw std::runtime_error("");
+#else
+		if (m_enc == ps_enc_t::Zstd)
+			throw std::runtime_error("");
+#endif
+	}
+
+	inline ~PsInflate()
+	{
+		if (m_enc == ps_enc_t::Gzip)
+			::inflateEnd(&m_z);
+#ifdef PS_USE_ZSTD
+		if (m_zs)
+			::ZSTD_freeDStream(m_zs);
+#endif
+	}
+
+	PsInflate(const PsInflate &) = delete;
+	PsInflate &operator=(const PsInflate &) = delete;
+
+	template<typename O>
+	inline void
+	update(const void *data, size_t len, O out)
+	{
+		if (m_enc == ps_enc_t::Identity) {
+			if (len)
+				out((const unsigned char *) data, len);
+			return;
+		}
+		if (m_end && len)
+			throw std::runtime_error("");
+		if (m_enc == ps_enc_t::Gzip) {
+			m_z.next_in = (Bytef *) data;
+			m_z.avail_in = (uInt) len;
+			while (!m_end && (m_z.avail_in || !m_z.avail_out)) {
+				m_z.next_out = m_buf.get();
+				m_z.avail_out = (uInt) s_buf;
+				const int r = ::inflate(&m_z, Z_NO_FLUSH);
+				if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR)
+					throw std::runtime_error("");
+				if (const size_t n = s_buf - m_z.avail_out)
+					out((const unsigned char *) m_buf.get(), n);
+				m_end = r == Z_STREAM_END;
+				if (r == Z_BUF_ERROR && m_z.avail_out)
+					break;
+			}
+			// bytes past the end of the stream
+			if (m_z.avail_in)
+				throw std::runtime_error("");
+		}
+#ifdef PS_USE_ZSTD
+		if (m_enc == ps_enc_t::Zstd) {
+			ZSTD_inBuffer in = { data, len, 0 };
+			for (bool full = true; in.pos < in.size || full;) {
+				ZSTD_outBuffer o = { m_buf.get(), s_buf, 0 };
+				const size_t r = ::ZSTD_decompressStream(m_zs, &o, &in);
+				if (::ZSTD_isError(r))
+					throw std::runtime_error("");
+				if (o.pos)
+					out((const unsigned char *) m_buf.get(), o.pos);
+				full = o.pos == s_buf;
+				m_end = r == 0;
+			}
+		}
+#endif
+	}
+
+	inline void
+	finish()
+	{
+		if (!m_end)
+			throw std::runtime_error("");
+	}
+
+	ps_enc_t m_enc;
+	z_stream m_z;
+	bool m_end;
+	std::unique_ptr<unsigned char[]> m_buf;
+#ifdef PS_USE_ZSTD
+	ZSTD_DStream *m_zs = nullptr;
+#endif
+};
+
+/* whole-body convenience over PsInflate */
+inline std::string
+_enc_decode(ps_enc_t enc, const std::string &data)
+{
+	if (enc == ps_enc_t::Identity)
+		return data;
+	std::string r;
+	PsInflate dec(enc);
+	dec.update(data.data(), data.size(), [&](const unsigned char *p, size_t n) { r.append((const char *) p, n); });
+	dec.finish();
+	return r;
+}
+
+/* compresses file src into dst (as a single gzip member or zstd frame) - returns the compressed size */
+inline uint64_t
+_file_compress(const boost::filesystem::path &src, const boost::filesystem::path &dst, ps_enc_t enc)
+{
+	boost::filesystem::ifstream ifst = boost::filesystem::ifstream(src, std::ios_base::in | std::ios_base::binary);
+	boost::filesystem::ofstream ofst = boost::filesystem::ofstream(dst, std::ios_base::out | std::ios_base::binary);
+	if (!ifst.is_open() || !ofst.is_open())
+		throw std::runtime_error("");
+	std::unique_ptr<char[]> ibuf(new char[PsInflate::s_buf]), obuf(new char[PsInflate::s_buf]);
+	uint64_t nout = 0;
+	const auto put = [&](size_t n) {
+		if (n && !ofst.write(obuf.get(), n))
+			throw std::runtime_error("");
+		nout += n;
+	};
+	if (enc == ps_enc_t::Gzip) {
+		z_stream z = {};
+		if (::deflateInit2(&z, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			throw std::runtime_error("");
+		std::unique_ptr<z_stream, int (*)(z_stream *)> zend(&z, &::deflateEnd);
+		for (bool last = false; !last;) {
+			ifst.read(ibuf.get(), PsInflate::s_buf);
+			if (ifst.bad())
+				throw std::runtime_error("");
+			last = ifst.eof();
+			z.next_in = (Bytef *) ibuf.get();
+			z.avail_in = (uInt) ifst.gcount();
+			do {
+				z.next_out = (Bytef *) obuf.get();
+				z.avail_out = (uInt) PsInflate::s_buf;
+				if (::deflate(&z, last ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR)
+					throw std::runtime_error("");
+				put(PsInflate::s_buf - z.avail_out);
+			} while (!z.avail_out);
+		}
+	}
+#ifdef PS_USE_ZSTD
+	else if (enc == ps_enc_t::Zstd) {
+		std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> cctx(::ZSTD_createCCtx(), &::ZSTD_freeCCtx);
+		if (!cctx || ::ZSTD_isError(::ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, 19)))
+			throw std::runtime_error("");
+		for (bool last = false; !last;) {
+			ifst.read(ibuf.get(), PsInflate::s_buf);
+			if (ifst.bad())
+				throw std::runtime_error("");
+			last = ifst.eof();
+			ZSTD_inBuffer in = { ibuf.get(), (size_t) ifst.gcount(), 0 };
+			for (size_t left = 1; in.pos < in.size || (last && left);) {
+				ZSTD_outBuffer o = { obuf.get(), PsInflate::s_buf, 0 };
+				left = ::ZSTD_compressStream2(cctx.get(), &o, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+				if (::ZSTD_isError(left))
+					throw std::runtime_error("");
+				put(o.pos);
+			}
+		}
+	}
+#endif
+	else
+		throw std::runtime_error("");
+	if (!ofst.flush())
+		throw std::runtime_error("");
+	return nout;
+}
+
+#endif /* _PSZIP_HPP_ */